@@ -11,16 +11,31 @@
 #include "hal/rotary_encoder_statemachine.h"
 #include "hal/pwm_rotary.h"
 #include "hal/lcd.h"
+#include "hal/metrics_http.h"
+#include "hal/params.h"
+#include "hal/i2c_bus.h"
+#include "hal/pwm_controller.h"
+#include "hal/pwm_sweep.h"
 
 
 int main() {
     //Starts each thread and initializes the hardware, such as UDP listener, light sensor, rotary encoder, PWM, and LCD.
+    Params_init(PARAMS_CONFIG_FILE);
     UdpListener_init();
+    I2cBus_init();
+    PwmController_init();
+    PwmSweep_init();
     Sampler_init();
     Lcd_init();
+    MetricsHttp_init();
     
     UdpListener_cleanup();
-    Sampler_cleanup();
+    MetricsHttp_cleanup();
     Lcd_cleanup();
+    Sampler_cleanup();
+    I2cBus_cleanup();
+    PwmSweep_cleanup();
+    PwmController_cleanup();
+    Params_cleanup();
     return 0;
 }
@@ -11,18 +11,28 @@
 #  python3 as2UdpGui.py
 
 import socket
+import struct
 import _thread
 from tkinter import *
 from tkinter import ttk
 from matplotlib.figure import Figure 
 from matplotlib.backends.backend_tkagg import FigureCanvasTkAgg
 
-SEND_BUTTON_TEXTS = ["help", "?", "count", "length", "dips", "history", "", "stop"]
+SEND_BUTTON_TEXTS = ["help", "?", "count", "length", "dips", "history", "history minmax 150", "bhistory delta", "", "stop"]
+
+# Binary protocol (see hal/include/hal/udp_protocol.h)
+BINARY_HEADER = struct.Struct(">HBBBBBBIIHH")
+BINARY_MAGIC = 0x4C53
+BINARY_MSG_HISTORY = 1
+BINARY_FLAG_DELTA = 0x01
+BINARY_DELTA_ESCAPE = 0x80
+ADC_TO_VOLTS = 3.3 / 4096
 
 # ****************************************
 #  UDP SOCKET TX/RX
 # ****************************************
 sock = 0    # UDP socket (global)
+data = []   # Samples to plot (global)
 
 # Written with lots of help from ChatGPT!
 def openPort(): 
@@ -62,6 +72,32 @@ def rxTextToData(rxText):
             data.append(float(str))
     return data
 
+def isBinaryDatagram(raw):
+    return len(raw) >= BINARY_HEADER.size and struct.unpack_from(">H", raw)[0] == BINARY_MAGIC
+
+# Decode one binary history datagram into a list of voltages.
+def binaryHistoryToData(raw):
+    (magic, version, msgType, flags, chunk, chunks, _, seq, epoch,
+        first, count) = BINARY_HEADER.unpack_from(raw)
+    if msgType != BINARY_MSG_HISTORY:
+        return []
+    payload = raw[BINARY_HEADER.size:]
+    samples = []
+    if not (flags & BINARY_FLAG_DELTA):
+        samples = [s for (s,) in struct.iter_unpack(">H", payload[:2 * count])]
+    elif count > 0:
+        samples.append(struct.unpack_from(">H", payload)[0])
+        pos = 2
+        while len(samples) < count:
+            if payload[pos] == BINARY_DELTA_ESCAPE:
+                samples.append(struct.unpack_from(">H", payload, pos + 1)[0])
+                pos += 3
+            else:
+                samples.append(samples[-1] + struct.unpack_from(">b", payload, pos)[0])
+                pos += 1
+    print("BINARY: epoch %d seq %d chunk %d/%d samples %d" % (epoch, seq, chunk + 1, chunks, count))
+    return [s * ADC_TO_VOLTS for s in samples]
+
 # Listen for incoming messages on UDP port
 # SOURCE: https://stackoverflow.com/a/66411955
 def listening_thread():
@@ -69,6 +105,10 @@ def listening_thread():
     global rxText
     while True:
         data_raw, addr = sock.recvfrom(4096)
+        if isBinaryDatagram(data_raw):
+            data = data + binaryHistoryToData(data_raw)
+            rxText.set("<binary history: %d samples>" % len(data))
+            continue
         data = data_raw.decode()    # My test message is encoded
         print (data)
         display = (rxText.get() + "\n" + data).strip()
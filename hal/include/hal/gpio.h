@@ -29,6 +29,18 @@ void Gpio_cleanup(void);
 //  pinNumber: such as 15
 struct GpioLine* Gpio_openForEvents(enum eGpioChips chip, int pinNumber);
 
+// Subscribe to both edges of `line` once (a no-op if it already is); events
+// queue in the kernel until read, so none are lost between reads.
+void Gpio_requestEvents(struct GpioLine* line);
+
+// Readable while `line` has events queued, for poll()/epoll; valid until Gpio_close().
+int Gpio_getEventFd(struct GpioLine* line);
+
+// Read up to `maxEvents` queued events in one call; blocks if there are none,
+// unless the event fd was made non-blocking (then -1 with errno EAGAIN).
+// Returns the number read, or -1.
+int Gpio_readEvents(struct GpioLine* line, struct gpiod_line_event *events, int maxEvents);
+
 int Gpio_waitForLineChange(
     struct GpioLine* line1, 
     struct GpioLine* line2, 
@@ -1,8 +1,22 @@
-/* i2c.h 
- * 
- * This file declares functions for initializing and cleaning up the I2C interface, 
+/* i2c.h
+ *
+ * This file declares functions for initializing and cleaning up the I2C interface,
  * opening an I2C bus, and performing 16-bit register read/write operations.
- * 
+ *
+ * Register accesses go through the I2C_RDWR ioctl: a read is one combined
+ * transaction (write the register pointer, repeated start, read the value),
+ * and I2c_transferBatch() sends several accesses in a single syscall.
+ *
+ * Bus errors never end the program. A transient failure (NACK, timeout, busy
+ * bus) is retried up to I2C_MAX_ATTEMPTS times with a doubling backoff; if it
+ * still fails the call returns -errno and the caller decides what to do.
+ * Every opened device keeps error counters and bus timing (latency histogram,
+ * bytes moved, time on the bus), see I2c_getStats().
+ *
+ * A simulated device can be attached to a bus path and address before it is
+ * opened (see I2c_attachSimulator()); it then receives the same i2c_msg
+ * transactions the kernel would, so everything above this layer runs as is.
+ *
  * These methods are taken from class guide: I2C Guide
  */
 
@@ -10,11 +24,68 @@
 #define _I2C_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <linux/i2c.h>
+
+// Most register accesses one I2c_transferBatch() call accepts
+#define I2C_MAX_BATCH 16
+
+// Tries per transfer; the waits in between are 100, 200, 400 us
+#define I2C_MAX_ATTEMPTS 4
+
+// One 16-bit register access. `value` is sent for a write and filled in for a
+// read, in the same byte order as write_i2c_reg16() and read_i2c_reg16().
+typedef struct {
+    uint8_t reg_addr;
+    bool isRead;
+    uint16_t value;
+} I2c_transfer_t;
+
+// Upper bounds (us) of the transaction latency buckets; the last bucket is open ended
+#define I2C_LATENCY_BUCKETS 9
+#define I2C_LATENCY_BOUNDS_US { 25, 50, 100, 200, 400, 800, 1600, 3200 }
+
+typedef struct {
+    uint16_t address;
+    unsigned long transfers;  // Calls that reached the bus
+    unsigned long errors;     // Failed attempts, including ones a retry fixed
+    unsigned long retries;
+    unsigned long failures;   // Calls that gave up and returned an error
+    unsigned long long bytesWritten;  // Payload of successful calls (register pointers included)
+    unsigned long long bytesRead;
+    unsigned long long busyUs;        // Time spent in the ioctl, retries and backoff included
+    unsigned long maxLatencyUs;
+    unsigned long latencyBuckets[I2C_LATENCY_BUCKETS];  // Calls per latency bucket
+    double utilisation;       // Fraction of the previous complete second spent on the bus
+} I2c_stats_t;
+
+// Stands in for the I2C_RDWR ioctl: run `numMessages` messages addressed to
+// the device. Returns numMessages, or -1 with errno set (e.g. EREMOTEIO for a NACK).
+typedef int (*I2c_simulatorTransfer_t)(void *context, struct i2c_msg *messages, int numMessages);
 
 void I2c_initialize(void);
 void I2c_cleanUp(void);
+
+// Serve `address` on `bus` from `transfer` instead of the hardware. Takes
+// effect for init_i2c_bus() calls made afterwards.
+void I2c_attachSimulator(const char *bus, int address, I2c_simulatorTransfer_t transfer, void *context);
+
+// Open `bus` for the device at `address`. Returns the file descriptor, or
+// -errno if the bus cannot be opened; the caller reports it, so a caller that
+// retries can report it once.
 int init_i2c_bus(const char* bus, int address);
-void write_i2c_reg16(int i2c_file_desc, uint8_t reg_addr, uint16_t value);
-uint16_t read_i2c_reg16(int i2c_file_desc, uint8_t reg_addr);
 
-#endif
\ No newline at end of file
+// Return 0, or -errno once the retries are used up.
+int write_i2c_reg16(int i2c_file_desc, uint8_t reg_addr, uint16_t value);
+int read_i2c_reg16(int i2c_file_desc, uint8_t reg_addr, uint16_t *value);
+
+// Run `count` accesses in order as one I2C transaction (repeated starts
+// between them, one stop at the end). A retry repeats the whole batch.
+// Returns 0, or -errno; read values are only valid on success.
+int I2c_transferBatch(int i2c_file_desc, I2c_transfer_t *transfers, int count);
+
+// Copy the statistics of the device opened as `i2c_file_desc`.
+// Returns 0, or -EBADF if it is not an open bus.
+int I2c_getStats(int i2c_file_desc, I2c_stats_t *stats);
+
+#endif
@@ -0,0 +1,84 @@
+/* i2c_bus.h
+ *
+ * This file declares the I2C bus workers. Each bus (e.g. /dev/i2c-1) is owned
+ * by one thread that runs the transactions queued for every device on it, so
+ * sensors sharing a bus never contend for it.
+ *
+ * Requests are served highest priority first and in order within a priority,
+ * so the light sampler's reads jump ahead of slower sensors. Back-to-back
+ * requests for the same device are merged into one I2C_RDWR transaction while
+ * they fit in I2C_MAX_BATCH accesses.
+ *
+ * Queue waits and transaction times are recorded in the metrics registry, and
+ * every device's bus statistics can be read with I2cBus_getStats().
+ *
+ * The caller owns each request and must keep it alive until it completes:
+ * either wait for it with I2cBus_wait() (a future), or give it a callback,
+ * which runs on the bus thread and then hands the request back.
+ */
+
+#ifndef _I2C_BUS_H_
+#define _I2C_BUS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hal/i2c.h"
+
+#define I2C_BUS_MAX_BUSES 2
+
+typedef enum {
+    I2C_BUS_PRIORITY_SAMPLING,    // Timing critical (light sampler)
+    I2C_BUS_PRIORITY_NORMAL,
+    I2C_BUS_PRIORITY_BACKGROUND,
+    I2C_BUS_PRIORITY_COUNT
+} I2cBus_priority_t;
+
+typedef struct I2cBus_request I2cBus_request_t;
+
+// Runs on the bus thread; keep it short, it holds up the bus.
+typedef void (*I2cBus_callback_t)(I2cBus_request_t *request);
+
+struct I2cBus_request {
+    // Filled in by the caller
+    int device;                           // From I2cBus_openDevice()
+    I2c_transfer_t transfers[I2C_MAX_BATCH];
+    int count;
+    I2cBus_priority_t priority;
+    I2cBus_callback_t callback;           // NULL to wait with I2cBus_wait()
+    void *context;                        // For the callback
+
+    // Filled in by the bus
+    int result;                           // 0, or -errno (see I2c_transferBatch())
+
+    // Private to the bus
+    bool isDone;
+    int64_t submittedUs;
+    I2cBus_request_t *next;
+};
+
+void I2cBus_init(void);
+
+// Finish the queued requests, then stop every bus thread and close the devices.
+void I2cBus_cleanup(void);
+
+// Open the device at `address` on the bus at `path`, starting the bus thread
+// on first use. Returns a device handle, or -errno.
+int I2cBus_openDevice(const char *path, int address);
+
+// Queue `request`. Returns 0, or -EINVAL for a bad request.
+int I2cBus_submit(I2cBus_request_t *request);
+
+// Block until a request submitted without a callback completes; returns its result.
+int I2cBus_wait(I2cBus_request_t *request);
+
+// Submit and wait: run `count` accesses on `device` with `priority`.
+int I2cBus_transfer(int device, I2c_transfer_t *transfers, int count, I2cBus_priority_t priority);
+
+// Devices are numbered 0 .. I2cBus_getNumDevices() - 1.
+int I2cBus_getNumDevices(void);
+const char* I2cBus_getPath(int device);
+
+// Copy the bus statistics of `device` (see I2c_getStats()). Returns 0, or -EINVAL.
+int I2cBus_getStats(int device, I2c_stats_t *stats);
+
+#endif
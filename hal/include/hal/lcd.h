@@ -1,12 +1,14 @@
 /* lcd.h
-* LCD module starts thread that updates the screen with the current frequency, dip count and max time every second.
+* LCD module updates the screen with the current frequency, dip count and max time every second.
 */
 #ifndef _LCD_H_
 #define _LCD_H_
 
 /* 
-* Lcd_init starts thread that updates the screen with the current frequency, dip count and max time every second.
-* It initializes the draw_stuff module.
+* Lcd_init starts thread that updates the screen with the current frequency, dip count and max time
+* every lcd_refresh_ms. It initializes the draw_stuff module; with adc_simulated set there is no
+* display, and neither the module nor the thread is started.
+* Call after Sampler_init(); call Lcd_cleanup() before Sampler_cleanup().
 */
 void Lcd_init();
 void Lcd_cleanup();
@@ -22,14 +22,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "hal/periodTimer.h"
 
 #define LIGHTSENSOR_FILE_NAME "/dev/hat/pwm/GPIO12"
+#define MAX_HISTORY_SIZE 1200 // Maximum samples stored per second
 
 void Sampler_init(void);
 
 void Sampler_cleanup(void);
 
-double Sampler_getReading(void);
+// Take one sample. Returns false, and records a gap, if the ADC cannot be read.
+bool Sampler_getReading(double *reading);
 
 // // Must be called once every 1s.
 // // Moves the samples that it has been collecting this second into
@@ -46,6 +50,14 @@ int Sampler_getHistorySize(void);
 // // Note: It provides both data and size to ensure consistency.
 double* Sampler_getHistory(int *size);
 
+// Copy the raw ADC readings of the previous complete second into `samples`
+// (at most maxSize of them) without allocating. Returns the number copied and
+// sets `epoch` to the number of that second (counts up from 1 at each rollover).
+int Sampler_getHistoryRaw(uint16_t *samples, int maxSize, uint32_t *epoch);
+
+// Number of the most recently completed second (0 before the first rollover).
+uint32_t Sampler_getHistoryEpoch(void);
+
 // // Get the average light level (not tied to the history).
 double Sampler_getAverageReading(void);
 
@@ -55,8 +67,14 @@ long long Sampler_getNumSamplesTaken(void);
 // Return dip count for previous second samples.
 int Sampler_getDipCount(void);
 
+// Return the number of samples missed (ADC read failures) in the previous second.
+int Sampler_getGapCount(void);
+
 //Return maxTime from periodTimer
 double Sampler_getMaxTime(void);
 
+// Fill `pStats` with the sample timing statistics of the previous second.
+void Sampler_getPeriodStatistics(Period_statistics_t *pStats);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+/* metrics.h
+ *
+ * This file declares the process wide metrics registry. Modules update
+ * counters, gauges and latency histograms with single atomic operations, and
+ * the exposition (Prometheus text format) only reads those atomics, so
+ * scraping never takes a lock the sampler or the UDP workers use.
+ *
+ * Values are stored as integers in the unit named by the id (e.g. millivolts,
+ * microseconds) and converted to Prometheus base units (volts, seconds) when
+ * formatted. No init is needed: every value starts at zero.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum Metrics_id {
+    METRICS_SAMPLES_TOTAL,
+    METRICS_SAMPLES_LAST_SECOND,
+    METRICS_DIPS_LAST_SECOND,
+    METRICS_AVERAGE_MILLIVOLTS,
+    METRICS_PWM_FREQUENCY_HZ,
+    METRICS_SAMPLE_PERIOD_MIN_US,
+    METRICS_SAMPLE_PERIOD_MAX_US,
+    METRICS_SAMPLE_PERIOD_AVG_US,
+    METRICS_SAMPLE_GAPS,
+    METRICS_SAMPLES_DROPPED,
+    METRICS_I2C_ERRORS,
+    METRICS_I2C_FAILURES,
+    METRICS_I2C_BYTES,
+    METRICS_I2C_BUSY_US,
+    METRICS_UDP_REQUESTS,
+    METRICS_UDP_RATE_LIMITED,
+    METRICS_UDP_QUEUE_FULL,
+    METRICS_UDP_CACHE_HITS,
+    METRICS_UDP_CACHE_MISSES,
+    METRICS_COUNT
+};
+
+enum Metrics_histogramId {
+    METRICS_UDP_QUEUE_WAIT_US,  // Request received until a worker picks it up
+    METRICS_UDP_HANDLE_US,      // Worker time to handle one request
+    METRICS_I2C_QUEUE_WAIT_US,  // I2C request queued until its bus thread starts it
+    METRICS_I2C_TRANSFER_US,    // One I2C transaction, retries included
+    METRICS_HISTOGRAM_COUNT
+};
+
+void Metrics_add(enum Metrics_id id, int64_t delta);
+void Metrics_set(enum Metrics_id id, int64_t value);
+int64_t Metrics_get(enum Metrics_id id);
+
+// Record one latency of `us` microseconds.
+void Metrics_observe(enum Metrics_histogramId id, int64_t us);
+
+// Monotonic clock in microseconds, for measuring latencies.
+int64_t Metrics_nowInUs(void);
+
+// Write every metric in Prometheus text exposition format into `buffer`.
+// Returns the length written (truncated at size - 1).
+size_t Metrics_formatPrometheus(char *buffer, size_t size);
+
+#endif
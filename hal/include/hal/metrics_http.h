@@ -0,0 +1,22 @@
+/* metrics_http.h
+ *
+ * This file declares a minimal HTTP/1.1 server that exposes the metrics
+ * registry (see metrics.h) for Prometheus on
+ *     http://<board>:METRICS_HTTP_PORT/metrics
+ * It runs on one thread with non-blocking sockets and an epoll loop, serves
+ * at most METRICS_HTTP_MAX_CONNECTIONS clients at a time from fixed buffers,
+ * and closes each connection after its response.
+ */
+
+#ifndef _METRICS_HTTP_H_
+#define _METRICS_HTTP_H_
+
+#define METRICS_HTTP_PORT 9433
+#define METRICS_HTTP_MAX_CONNECTIONS 4
+
+void MetricsHttp_init(void);
+
+// Stop the server thread and close every connection.
+void MetricsHttp_cleanup(void);
+
+#endif
@@ -0,0 +1,93 @@
+/* params.h
+ *
+ * This file declares the runtime parameter store. Tunables that used to be
+ * #defines (UDP port, sample period, dip detection, smoothing, PWM bounds, LCD
+ * refresh) are typed parameters with a range and a default. Modules read them
+ * with a single atomic load, so hot paths such as the 1 ms sampling loop can
+ * read them every time instead of caching them.
+ *
+ * Values come from the defaults, then the config file given to Params_init(),
+ * then `set` commands at runtime. Config file lines look like
+ *     # comment
+ *     dip_threshold_v = 0.12
+ * Parameters that are only read at startup (e.g. udp_port) can only be set in
+ * the config file. Related pairs are kept consistent: pwm_min_hz <= pwm_max_hz
+ * and dip_hysteresis_v < dip_threshold_v.
+ * Modules that must act on a change (e.g. reprogram a timer) register a
+ * callback with Params_onChange().
+ */
+
+#ifndef _PARAMS_H_
+#define _PARAMS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PARAMS_CONFIG_FILE "light_sampler.conf"
+
+enum Params_id {
+    PARAMS_UDP_PORT,
+    PARAMS_SAMPLE_PERIOD_US,
+    PARAMS_DIP_THRESHOLD_V,
+    PARAMS_DIP_HYSTERESIS_V,
+    PARAMS_SMOOTHING_FACTOR,
+    PARAMS_PWM_MIN_HZ,
+    PARAMS_PWM_MAX_HZ,
+    PARAMS_PWM_RAMP_MS,
+    PARAMS_ENCODER_ACCELERATION,
+    PARAMS_LCD_REFRESH_MS,
+    PARAMS_PRINT_STATISTICS,
+    PARAMS_ADC_SIMULATED,
+    PARAMS_PWM_SIMULATED,
+    PARAMS_SIM_OFFSET_V,
+    PARAMS_SIM_SINE_V,
+    PARAMS_SIM_SINE_HZ,
+    PARAMS_SIM_SQUARE_V,
+    PARAMS_SIM_NOISE_V,
+    PARAMS_SIM_DIPS_PER_S,
+    PARAMS_SIM_DIP_V,
+    PARAMS_SIM_BUS_KHZ,
+    PARAMS_COUNT
+};
+
+typedef enum {
+    PARAMS_TYPE_INT,
+    PARAMS_TYPE_DOUBLE,
+    PARAMS_TYPE_BOOL,
+} Params_type_t;
+
+typedef void (*Params_callback_t)(enum Params_id id);
+
+// Set every parameter to its default, then apply `configPath` if it exists.
+// Call before any other module's init.
+void Params_init(const char *configPath);
+void Params_cleanup(void);
+
+// Lock free reads; the type must match the parameter's type.
+int Params_getInt(enum Params_id id);
+double Params_getDouble(enum Params_id id);
+bool Params_getBool(enum Params_id id);
+
+// Look up a parameter by name; returns -1 if there is none.
+int Params_find(const char *name);
+const char* Params_getName(enum Params_id id);
+
+// Whether `id` is only read at startup, so it cannot be changed at runtime.
+bool Params_isStartupOnly(enum Params_id id);
+
+// Parse `value` for the parameter's type and range and store it, then run the
+// change callbacks (on the calling thread). Returns false if it is invalid,
+// breaks a constraint with another parameter, or `id` is startup only.
+bool Params_setFromString(enum Params_id id, const char *value);
+
+// Write "name = value" (no newline) into `buffer`.
+void Params_format(enum Params_id id, char *buffer, size_t size);
+
+// Write the type, range and description, e.g. "int 0..1000 at most pwm_max_hz, lowest LED flash frequency".
+void Params_describe(enum Params_id id, char *buffer, size_t size);
+
+// Call `callback` after every change of `id`.
+void Params_onChange(enum Params_id id, Params_callback_t callback);
+
+#endif
@@ -0,0 +1,55 @@
+/* pwm.h
+ *
+ * This file declares a driver for one sysfs PWM channel (a directory such as
+ * /dev/hat/pwm/GPIO12/ with `period`, `duty_cycle`, `enable` and, where the
+ * driver supports it, `polarity` files). The files are opened once; each
+ * update is a single pwrite() of a preformatted value, and values equal to the
+ * last one written are skipped.
+ *
+ * The kernel rejects a duty cycle longer than the period, so a change of both
+ * writes them in the order that keeps duty <= period at every step: period
+ * first when it grows, duty cycle first when it shrinks. The output never has
+ * to be zeroed or disabled in between, so a frequency change does not glitch.
+ *
+ * A simulated channel has no files: it only keeps the cached state, so the
+ * rest of the application runs without PWM hardware.
+ */
+
+#ifndef _PWM_H_
+#define _PWM_H_
+
+#include <stdbool.h>
+
+#define PWM_UNKNOWN -1 // Cached value not known (yet)
+
+typedef struct {
+    bool isSimulated;
+    int periodFd;
+    int dutyCycleFd;
+    int enableFd;
+    int polarityFd;           // -1 if the driver has no polarity control
+    long long periodNs;       // Last value written (or read at open), or PWM_UNKNOWN
+    long long dutyCycleNs;
+    int enabled;              // 0, 1 or PWM_UNKNOWN
+    int inverted;             // 0, 1 or PWM_UNKNOWN
+} Pwm_channel_t;
+
+// Open the channel in `directory` (ending in '/') and read its current state.
+// Returns 0, or -errno if a file cannot be opened.
+int Pwm_open(Pwm_channel_t *channel, const char *directory);
+
+// Set up a channel without hardware: disabled, normal polarity, no period.
+void Pwm_openSimulated(Pwm_channel_t *channel);
+void Pwm_close(Pwm_channel_t *channel);
+
+// Set the period and duty cycle. Returns 0, or -errno of the failed write.
+int Pwm_setPeriod(Pwm_channel_t *channel, long long periodNs, long long dutyCycleNs);
+
+// Returns 0, or -errno of the failed write.
+int Pwm_setEnabled(Pwm_channel_t *channel, bool enabled);
+
+// Most drivers only accept this while the channel is disabled. Returns 0,
+// -ENOTSUP without a polarity file, or -errno of the failed write.
+int Pwm_setInverted(Pwm_channel_t *channel, bool inverted);
+
+#endif
@@ -0,0 +1,64 @@
+/* pwm_controller.h
+ *
+ * This file declares the PWM controller, which owns every PWM channel of the
+ * rig (see the channel enum below; adding an emitter is one entry there and
+ * one in the table in pwm_controller.c). Each channel's frequency, duty cycle,
+ * polarity and enable are cached and changed together by one
+ * PwmController_update(), so readers never see half an update and unchanged
+ * attributes are not written. Updates run on the caller's thread; the
+ * controller has no threads of its own.
+ *
+ * With pwm_simulated set (see params.h) the channels have no hardware and only
+ * keep their state. The `pwm` UDP command lists and changes the channels.
+ */
+
+#ifndef _PWM_CONTROLLER_H_
+#define _PWM_CONTROLLER_H_
+
+#include <stdbool.h>
+
+enum PwmController_channel {
+    PWM_CONTROLLER_LED,           // Flashing emitter, driven by the rotary encoder
+    PWM_CONTROLLER_COUNT
+};
+
+typedef struct {
+    int frequencyHz;              // 0 turns the output off
+    double dutyCycle;             // Fraction of the period the output is active, 0..1
+    bool isInverted;
+    bool isEnabled;
+} PwmController_settings_t;
+
+// Open every channel (simulated ones if pwm_simulated); call after UdpListener_init().
+void PwmController_init(void);
+void PwmController_cleanup(void);
+
+// Returns -1 if there is no channel called `name`.
+int PwmController_find(const char *name);
+const char* PwmController_getName(enum PwmController_channel channel);
+
+// Fields of PwmController_settings_t, for PwmController_update()
+enum {
+    PWM_CONTROLLER_FREQUENCY = 1 << 0,
+    PWM_CONTROLLER_DUTY_CYCLE = 1 << 1,
+    PWM_CONTROLLER_POLARITY = 1 << 2,
+    PWM_CONTROLLER_ENABLE = 1 << 3,
+};
+
+// Change the `fields` of `channel` to their values in `changes` at once; the
+// others keep their current values. The merge and the writes happen under the
+// channel's lock, so concurrent updates of different fields do not undo each
+// other. Returns 0, -EINVAL for settings out of range, or -errno of a failed
+// write (the cache then keeps the last settings that were applied in full).
+int PwmController_update(enum PwmController_channel channel, unsigned int fields,
+    const PwmController_settings_t *changes);
+
+void PwmController_get(enum PwmController_channel channel, PwmController_settings_t *settings);
+
+// Whether `hz` is within pwm_min_hz..pwm_max_hz, the bounds the encoder keeps to.
+bool PwmController_isFrequencyAllowed(int hz);
+
+// Frequency the channel is flashing at: 0 when it is off or disabled.
+int PwmController_getFrequency(enum PwmController_channel channel);
+
+#endif
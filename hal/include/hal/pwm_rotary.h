@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 //Starts thread that monitors rotary encoder and updates PWM frequency
+//(with adc_simulated there is no encoder: the frequency only changes over UDP)
 void PwmRotary_init(void);
 
 void PwmRotary_cleanup(void);
@@ -0,0 +1,50 @@
+/* pwm_sweep.h
+ *
+ * This file declares the PWM sweep engine, which moves a channel's frequency
+ * from one value to another over a set time on its own timer thread:
+ *   - linear: the frequency changes by the same number of Hz every tick,
+ *   - log: by the same ratio every tick (equal time per octave),
+ *   - steps: it holds each of `steps` evenly spaced frequencies for an equal
+ *     share of the time, changing exactly on the step boundaries.
+ * The frequency is computed from the time since the start, so late wake-ups
+ * never accumulate into drift, and the sweep ends on `toHz` at its deadline.
+ *
+ * Each channel runs at most one sweep; starting another replaces it from the
+ * current frequency. Only the frequency changes: duty cycle and polarity stay
+ * as they are and the output is enabled. Controlled over UDP with `sweep`,
+ * e.g. `sweep 10 500 30s log`.
+ */
+
+#ifndef _PWM_SWEEP_H_
+#define _PWM_SWEEP_H_
+
+#include <stdbool.h>
+#include "hal/pwm_controller.h"
+
+#define PWM_SWEEP_TICK_MS 10          // Update period of the ramps
+#define PWM_SWEEP_DEFAULT_STEPS 10
+
+typedef enum {
+    PWM_SWEEP_LINEAR,
+    PWM_SWEEP_LOG,
+    PWM_SWEEP_STEPS,
+} PwmSweep_shape_t;
+
+// Start the timer thread; call after PwmController_init().
+void PwmSweep_init(void);
+void PwmSweep_cleanup(void);
+
+// Sweep `channel` from `fromHz` to `toHz` over `durationMs`. `steps` is only
+// used by PWM_SWEEP_STEPS (at least 2). Returns 0, -ERANGE if either
+// frequency is outside pwm_min_hz..pwm_max_hz, or -EINVAL (log sweeps need
+// both frequencies above 0).
+int PwmSweep_start(enum PwmController_channel channel, int fromHz, int toHz, int durationMs,
+    PwmSweep_shape_t shape, int steps);
+
+// Stop the sweep on `channel`, leaving the frequency where it is.
+void PwmSweep_stop(enum PwmController_channel channel);
+
+// Frequency the running sweep ends on, or -1 if the channel is not sweeping.
+int PwmSweep_getTargetHz(enum PwmController_channel channel);
+
+#endif
@@ -8,8 +8,11 @@
  * - Uses a state machine to track rotary encoder position changes.  
  * - Supports incrementing and decrementing based on clockwise and  
  *   counterclockwise rotations.  
+ * - Accelerates: a detent counts 2, 4 or 8 when the knob spins fast
+ *   (encoder_acceleration parameter).
  * - Provides thread-based monitoring of GPIO events for reliable tracking.  
  * - Allows external components to retrieve or reset the encoder value. 
+ * - Lets one consumer block until the encoder turns instead of polling it.
 */
 #ifndef _BTN_STATEMACHINE_H_
 #define _BTN_STATEMACHINE_H_
@@ -21,10 +24,19 @@ void RotaryEncoderStateMachine_init(void);
 
 void RotaryEncoderStateMachine_cleanup(void);
 
+//Stop the monitoring thread, so RotaryEncoderStateMachine_waitForChange() returns;
+//call before joining the consumer, then RotaryEncoderStateMachine_cleanup()
+void RotaryEncoderStateMachine_stop(void);
+
 //Get the current value of the rotary encoder
 int RotaryEncoderStateMachine_getValue(void);
 
 //Set the value of the rotary encoder (mainly for resetting purposes)
 void RotaryEncoderStateMachine_setValue(int value);
 
+//Block until the value changes, then take it and reset it to 0, so every detent
+//since the last call arrives as one change. Returns 0 once the monitoring thread
+//has stopped (see RotaryEncoderStateMachine_stop()).
+int RotaryEncoderStateMachine_waitForChange(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,31 @@
+/* tla2024_sim.h
+ *
+ * This file declares an in-process simulation of the TLA2024 12-bit ADC that
+ * the light sensor is wired to. Attached behind the I2C HAL (see
+ * I2c_attachSimulator()), it answers the same register transactions as the
+ * chip. With adc_simulated set the application runs on any Linux host: the
+ * sampler reads this simulator, the rotary encoder's GPIO lines and the LCD
+ * are not opened, and PWM channels fall back to simulated ones. The simulator:
+ *   - Config register (0x01): MUX, PGA, MODE and DR fields; writing OS = 1 in
+ *     single-shot mode starts a conversion, and OS reads 0 while it runs.
+ *   - Conversion register (0x00): left-justified two's complement result,
+ *     updated one conversion time (1 / data rate) after it started. In
+ *     continuous mode a config write restarts the conversion, as on the chip.
+ *
+ * The positive input of the selected MUX pair is driven by one waveform, the
+ * sum of a DC level, a sine, a square wave at the LED's PWM frequency, uniform
+ * noise and periodic dips (negative inputs read 0 V). The amplitudes are the
+ * sim_* parameters (see params.h) and can be changed at runtime with `set`.
+ * Transfers take as long as they would at sim_bus_khz.
+ */
+
+#ifndef _TLA2024_SIM_H_
+#define _TLA2024_SIM_H_
+
+#define TLA2024_SIM_DIP_MS 5 // Length of each simulated dip
+
+// Attach the simulated ADC at `address` on `bus`; call after I2c_initialize()
+// and before the device is opened.
+void Tla2024Sim_attach(const char *bus, int address);
+
+#endif
@@ -0,0 +1,55 @@
+/* udp_batch.h
+ *
+ * This file declares a batch of outgoing UDP datagrams that are sent with a
+ * single sendmmsg() call instead of one sendto() per datagram. A batch is
+ * allocated once and reused for every reply. UdpBatch_add() only stores
+ * pointers to the payload and address, so both must stay valid until
+ * UdpBatch_send(); UdpBatch_addCopy() copies the payload into the batch, so
+ * only the address must.
+ */
+
+#ifndef _UDP_BATCH_H_
+#define _UDP_BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+// Enough for a text history reply (10 values per datagram) or a push to
+// every subscriber
+#define UDP_BATCH_MAX_DATAGRAMS 128
+#define UDP_BATCH_COPY_SIZE 16384 // Payload bytes UdpBatch_addCopy() can hold
+
+// Opaque structure
+struct UdpBatch;
+
+struct UdpBatch* UdpBatch_create(void);
+void UdpBatch_destroy(struct UdpBatch *batch);
+
+// Queue `length` bytes at `data` for `addr`. Returns false if the batch is full.
+bool UdpBatch_add(
+    struct UdpBatch *batch,
+    const void *data,
+    size_t length,
+    const struct sockaddr *addr,
+    socklen_t addrLen
+);
+
+// Copy `length` bytes at `data` into the batch and queue them for `addr`.
+// Returns false if the batch is full or the copies would not fit.
+bool UdpBatch_addCopy(
+    struct UdpBatch *batch,
+    const void *data,
+    size_t length,
+    const struct sockaddr *addr,
+    socklen_t addrLen
+);
+
+// Number of datagrams currently queued.
+int UdpBatch_size(const struct UdpBatch *batch);
+
+// Send everything queued on `sockfd` and empty the batch.
+// Returns the number of datagrams sent, or -1 on error.
+int UdpBatch_send(struct UdpBatch *batch, int sockfd);
+
+#endif
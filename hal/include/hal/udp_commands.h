@@ -0,0 +1,77 @@
+/* udp_commands.h
+ *
+ * This file declares the command table of the UDP listener. Modules register
+ * their own commands (name, argument schema, help text and handler) and the
+ * listener dispatches each request with a hash lookup, so adding commands does
+ * not make dispatch slower. The `help` reply is generated from the table.
+ *
+ * Argument schema: space separated arguments, `<name:spec>` for required and
+ * `[name:spec]` for optional ones. `spec` is a `|` separated list of types
+ * (`int`, `num`, `word`) or literal words, e.g. "[mode:delta|raw] [count:int]".
+ * A bare `[delta]` means that literal word. Requests whose arguments do not
+ * match the schema get a usage reply and never reach the handler.
+ */
+
+#ifndef _UDP_COMMANDS_H_
+#define _UDP_COMMANDS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define UDP_COMMANDS_MAX_COMMANDS 48
+#define UDP_COMMANDS_MAX_ARGS 6
+
+struct UdpBatch;
+
+// Everything a handler needs to reply to one request
+typedef struct {
+    int sockfd;
+    const struct sockaddr_in6 *addr;
+    struct UdpBatch *batch;          // Owned by the calling worker
+    int argc;                        // Including the command name
+    char *argv[UDP_COMMANDS_MAX_ARGS + 1];
+} UdpCommands_context_t;
+
+typedef void (*UdpCommands_handler_t)(UdpCommands_context_t *ctx);
+
+typedef struct {
+    const char *name;
+    const char *args;   // Argument schema (see above), "" for none
+    const char *help;   // NULL hides the command from `help` (aliases)
+    UdpCommands_handler_t handler;
+} UdpCommands_command_t;
+
+void UdpCommands_init(void);
+void UdpCommands_cleanup(void);
+
+// Add `command` to the table; the strings must stay valid (use literals).
+// Threadsafe: modules may register while the listener is serving requests.
+void UdpCommands_register(const UdpCommands_command_t *command);
+
+// Register every entry of `commands`.
+void UdpCommands_registerAll(const UdpCommands_command_t *commands, int count);
+
+// Split `line` in place, look up and validate the command and run its handler.
+// Replies with the usual "Unknown command" or a usage message otherwise.
+void UdpCommands_dispatch(UdpCommands_context_t *ctx, char *line);
+
+// Parse all of `text` as a decimal int, as the `int` argument spec does.
+// Returns false for anything else, including values that do not fit an int.
+bool UdpCommands_parseInt(const char *text, int *value);
+
+// Write the help text for every visible command into `buffer`.
+void UdpCommands_formatHelp(char *buffer, size_t size);
+
+// Reply helpers: send one datagram now, or queue on the worker's batch and
+// send everything queued with UdpCommands_flush() (done after every handler).
+// Queued data is copied into the batch, so it may live on the handler's stack;
+// the batch holds UDP_BATCH_COPY_SIZE bytes and is sent early when it fills.
+void UdpCommands_send(UdpCommands_context_t *ctx, const void *data, size_t length);
+void UdpCommands_reply(UdpCommands_context_t *ctx, const char *text);
+void UdpCommands_replyf(UdpCommands_context_t *ctx, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void UdpCommands_queue(UdpCommands_context_t *ctx, const void *data, size_t length);
+void UdpCommands_flush(UdpCommands_context_t *ctx);
+
+#endif
@@ -0,0 +1,53 @@
+/* udp_format.h
+ *
+ * This file declares the text formatter used to build UDP replies without
+ * snprintf() or heap allocation. Values are converted with integer arithmetic
+ * (voltages as fixed point millivolts) straight into a reusable per-thread
+ * arena, and replies of the form "<fixed text><number>\n" come from templates
+ * whose text length is known at compile time.
+ *
+ * The put functions follow the same style as the protocol encoder: each one
+ * writes at `p` and returns the position just past what it wrote. They do not
+ * NUL terminate and do no bounds checks; callers size their writes with the
+ * UDP_FORMAT_MAX_* constants.
+ */
+
+#ifndef _UDP_FORMAT_H_
+#define _UDP_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Big enough for a full text history (MAX_HISTORY_SIZE values of "x.xxx, ")
+#define UDP_FORMAT_ARENA_SIZE 16384
+#define UDP_FORMAT_MAX_UINT_LENGTH 20     // UINT64_MAX
+#define UDP_FORMAT_MAX_INT_LENGTH 20      // INT64_MIN
+#define UDP_FORMAT_MAX_VOLTS_LENGTH 6     // "65.535" (largest uint16 millivolts)
+
+// Reply text with its length, so sending it needs no strlen()
+typedef struct {
+    const char *text;
+    size_t length;
+} UdpFormat_template_t;
+
+#define UDP_FORMAT_TEMPLATE(literal) { literal, sizeof(literal) - 1 }
+
+// Start of the calling thread's arena (UDP_FORMAT_ARENA_SIZE bytes). The same
+// buffer is returned on every call from that thread, so a reply built in it
+// must be sent before the thread formats the next one.
+char* UdpFormat_getArena(void);
+
+// 12-bit ADC reading (3.3V reference) to millivolts, rounded like "%.3f".
+uint32_t UdpFormat_adcToMillivolts(uint16_t reading);
+
+// Millivolts as volts with three decimals, e.g. 1609 -> "1.609".
+char* UdpFormat_putVolts(char *p, uint32_t millivolts);
+
+char* UdpFormat_putUint(char *p, uint64_t value);
+char* UdpFormat_putInt(char *p, int64_t value);
+char* UdpFormat_putText(char *p, const UdpFormat_template_t *text);
+
+// `prefix`, then `value`, then a newline: "# Dips: " + 14 -> "# Dips: 14\n".
+char* UdpFormat_putTemplate(char *p, const UdpFormat_template_t *prefix, int64_t value);
+
+#endif
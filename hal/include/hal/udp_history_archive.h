@@ -0,0 +1,40 @@
+/* udp_history_archive.h
+ *
+ * This file declares the archive of recently sent binary history replies,
+ * which makes the chunked binary history reliable over lossy links. Every
+ * datagram of a binary history already carries its epoch, its chunk index and
+ * the chunk count (see udp_protocol.h), so a client can tell exactly which
+ * chunks it missed and ask for just those with
+ *     resend <epoch> <chunk> [delta]
+ * The archive answers from the datagrams it kept for the last
+ * UDP_HISTORY_ARCHIVE_DEPTH epochs, byte for byte as first sent, so clients
+ * should drop duplicates by (epoch, chunk).
+ */
+
+#ifndef _UDP_HISTORY_ARCHIVE_H_
+#define _UDP_HISTORY_ARCHIVE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hal/udp_protocol.h"
+
+#define UDP_HISTORY_ARCHIVE_DEPTH 8 // Epochs (seconds) a client has to ask for a resend
+
+// Registers the `resend` command.
+void UdpHistoryArchive_init(void);
+void UdpHistoryArchive_cleanup(void);
+
+// Keep the binary history reply of `epoch` (raw or delta encoded). Only the
+// first reply stored for an epoch and encoding is kept.
+void UdpHistoryArchive_store(
+    uint32_t epoch,
+    bool useDelta,
+    const UdpProtocol_datagram_t *datagrams,
+    int numDatagrams
+);
+
+// Copy chunk `chunk` of the reply of `epoch` into `datagram`.
+// Returns false if it is not (or no longer) in the archive.
+bool UdpHistoryArchive_get(uint32_t epoch, bool useDelta, int chunk, UdpProtocol_datagram_t *datagram);
+
+#endif
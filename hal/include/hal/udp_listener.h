@@ -5,6 +5,9 @@
     *  
     * The listener runs in a separate thread and interacts with the Sampler module  
     * to process and retrieve the required data.  
+    *
+    * That thread is an epoll event loop which also owns shutdown (the `stop`
+    * command, SIGINT and SIGTERM).
     */
 
 #ifndef _UDP_LISTENER_H_
@@ -15,6 +18,8 @@
 #include <stdbool.h>
 
 // start thread to listen for UDP messages
+// Blocks SIGINT and SIGTERM so the event loop can handle them; call this before
+// any other module creates threads so they inherit the signal mask.
 void UdpListener_init(void);
 
 // clean up thread
@@ -23,5 +28,8 @@ void UdpListener_cleanup(void);
 //return stop running flag
 bool UdpListener_isRunning(void);
 
+// Ask the program to end, as the `stop` command does.
+void UdpListener_stop(void);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+/* udp_protocol.h
+ *
+ * This file declares the binary variant of the UDP protocol. The text commands
+ * (count, length, dips, history, ...) stay for humans using netcat; programs such
+ * as the graphing GUI ask for the binary replies instead, which are much cheaper
+ * for the board to build and fit one second of samples in one or two datagrams.
+ *
+ * Every datagram starts with a 20 byte header (all fields big-endian):
+ *   offset  size  field
+ *   0       2     magic ("LS" = 0x4C53)
+ *   2       1     version (UDP_PROTOCOL_VERSION)
+ *   3       1     message type (UdpProtocol_messageType)
+ *   4       1     flags (UDP_PROTOCOL_FLAG_*)
+ *   5       1     chunk index within this reply
+ *   6       1     chunk count of this reply
+ *   7       1     reserved (0)
+ *   8       4     sequence number (increments for every datagram encoded;
+ *                 coalesced replies repeat the numbers of the cached copy)
+ *   12      4     epoch (number of the completed second the data belongs to)
+ *   16      2     index of the first sample carried in this datagram
+ *   18      2     number of samples carried in this datagram
+ *
+ * History payload: raw 12-bit ADC readings (volts = reading * 3.3 / 4096).
+ * - Without UDP_PROTOCOL_FLAG_DELTA: one uint16 per sample.
+ * - With UDP_PROTOCOL_FLAG_DELTA: the first sample of each datagram is a uint16,
+ *   then each following sample is an int8 difference from the previous one. A
+ *   difference that does not fit is sent as the escape byte 0x80 followed by the
+ *   uint16 sample. Each datagram can be decoded on its own.
+ * A client that misses a chunk (see the chunk index and count) can request it
+ * again with `resend <epoch> <chunk> [delta]` (see udp_history_archive.h).
+ *
+ * Stats payload: see UdpProtocol_stats_t, encoded in field order.
+ */
+
+#ifndef _UDP_PROTOCOL_H_
+#define _UDP_PROTOCOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hal/light_sensor.h"
+
+#define UDP_PROTOCOL_MAGIC 0x4C53
+#define UDP_PROTOCOL_VERSION 1
+#define UDP_PROTOCOL_HEADER_SIZE 20
+#define UDP_PROTOCOL_MAX_DATAGRAM 1452 // Ethernet MTU less IPv6 and UDP headers (the socket is dual stack)
+#define UDP_PROTOCOL_DELTA_ESCAPE 0x80
+
+// Worst case is every sample escaped in delta mode (3 bytes each)
+#define UDP_PROTOCOL_MAX_HISTORY_DATAGRAMS \
+    ((MAX_HISTORY_SIZE * 3) / (UDP_PROTOCOL_MAX_DATAGRAM - UDP_PROTOCOL_HEADER_SIZE) + 1)
+
+#define UDP_PROTOCOL_FLAG_DELTA 0x01
+
+enum UdpProtocol_messageType {
+    UDP_PROTOCOL_MSG_HISTORY = 1,
+    UDP_PROTOCOL_MSG_STATS = 2,
+};
+
+typedef struct {
+    uint8_t data[UDP_PROTOCOL_MAX_DATAGRAM];
+    int length;
+} UdpProtocol_datagram_t;
+
+typedef struct {
+    uint64_t samplesTotal;
+    uint32_t samplesLastSecond;
+    uint32_t dips;
+    uint32_t averageMillivolts;
+    uint32_t pwmFrequencyHz;
+    uint32_t minPeriodInUs;
+    uint32_t maxPeriodInUs;
+    uint32_t avgPeriodInUs;
+} UdpProtocol_stats_t;
+
+// Fill `stats` with the current values from the Sampler and PWM modules.
+void UdpProtocol_collectStats(UdpProtocol_stats_t *stats);
+
+// Encode `count` samples of second `epoch` into as many datagrams as needed.
+// Returns the number of datagrams filled in `datagrams` (at most maxDatagrams).
+int UdpProtocol_encodeHistory(
+    const uint16_t *samples,
+    int count,
+    uint32_t epoch,
+    bool useDelta,
+    UdpProtocol_datagram_t *datagrams,
+    int maxDatagrams
+);
+
+// Encode the statistics of second `epoch` into a single datagram.
+void UdpProtocol_encodeStats(
+    const UdpProtocol_stats_t *stats,
+    uint32_t epoch,
+    UdpProtocol_datagram_t *datagram
+);
+
+#endif
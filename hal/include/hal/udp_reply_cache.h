@@ -0,0 +1,55 @@
+/* udp_reply_cache.h
+ *
+ * This file declares the reply cache of the UDP listener, which coalesces
+ * identical requests: the first request for a command line in a sampling epoch
+ * builds the reply (all of its datagrams) once, and every identical request
+ * until the Sampler completes the next second is sent straight from the cached
+ * bytes with sendmmsg(). The Sampler's epoch counter is the invalidation: a
+ * reply built for an older epoch is rebuilt on its next request. Many clients
+ * polling `history`, `length` or `dips` then cost one encode per second.
+ *
+ * Entries are keyed by the command line and replaced least recently used
+ * first. All functions are threadsafe.
+ */
+
+#ifndef _UDP_REPLY_CACHE_H_
+#define _UDP_REPLY_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hal/udp_commands.h"
+
+#define UDP_REPLY_CACHE_ENTRIES 8
+#define UDP_REPLY_CACHE_DATA_SIZE 16384
+#define UDP_REPLY_CACHE_MAX_DATAGRAMS 128
+
+// One cached reply, filled in by a builder
+typedef struct {
+    uint32_t epoch;              // Epoch of the data the reply was built from
+    int numDatagrams;
+    size_t used;                 // Bytes of `data` in use
+    size_t offsets[UDP_REPLY_CACHE_MAX_DATAGRAMS];
+    size_t lengths[UDP_REPLY_CACHE_MAX_DATAGRAMS];
+    char data[UDP_REPLY_CACHE_DATA_SIZE];
+} UdpReplyCache_reply_t;
+
+// Build the reply for `ctx` (same arguments as the handler) into `reply`:
+// set reply->epoch and add each datagram, either by writing at
+// reply->data + reply->used and calling UdpReplyCache_commit(), or by copying
+// with UdpReplyCache_append().
+typedef void (*UdpReplyCache_builder_t)(UdpReplyCache_reply_t *reply, UdpCommands_context_t *ctx);
+
+void UdpReplyCache_init(void);
+void UdpReplyCache_cleanup(void);
+
+// Send the reply for ctx's command line, building it with `builder` if there
+// is no reply for the current epoch yet.
+void UdpReplyCache_serve(UdpCommands_context_t *ctx, UdpReplyCache_builder_t builder);
+
+// Record the `length` bytes written at reply->data + reply->used as a datagram.
+void UdpReplyCache_commit(UdpReplyCache_reply_t *reply, size_t length);
+
+// Copy `length` bytes at `data` into the reply as a datagram.
+void UdpReplyCache_append(UdpReplyCache_reply_t *reply, const void *data, size_t length);
+
+#endif
@@ -0,0 +1,43 @@
+/* udp_sessions.h
+ *
+ * This file declares the per-client session table of the UDP listener. Each
+ * client address (IP and port) gets its own session, so features such as
+ * "<enter> repeats the last command" no longer leak between monitoring
+ * stations polling the same board. A token bucket per host (IPv4 address or
+ * IPv6 /64, whatever the port) limits how fast one client can make the board
+ * work, so a client cannot escape it by changing its source port.
+ *
+ * Both tables are small fixed-size hash tables. When the session table is full
+ * the least recently seen client is forgotten; a host's bucket is only
+ * forgotten once it has refilled, and new hosts share one bucket while none
+ * has. All functions are threadsafe.
+ */
+
+#ifndef _UDP_SESSIONS_H_
+#define _UDP_SESSIONS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define UDP_SESSIONS_MAX_CLIENTS 64
+#define UDP_SESSIONS_MAX_HOSTS 64
+#define UDP_SESSIONS_MAX_COMMAND 128
+#define UDP_SESSIONS_RATE_PER_S 20   // Sustained requests per second per host
+#define UDP_SESSIONS_BURST 40        // Requests a quiet host may send at once
+
+void UdpSessions_init(void);
+void UdpSessions_cleanup(void);
+
+// Apply the "repeat last command" rule for the client at `addr`:
+// - If `command` is non-empty, remember it as the client's last command.
+// - If it is empty, replace it with the client's last command.
+// Returns false if `command` is empty and the client has no last command.
+bool UdpSessions_resolveCommand(const struct sockaddr_in6 *addr, char *command, size_t size);
+
+// Take one token from the bucket of the host at `addr`. Returns false (and
+// takes nothing) if the host is over its rate limit and the request should be
+// dropped.
+bool UdpSessions_admitRequest(const struct sockaddr_in6 *addr);
+
+#endif
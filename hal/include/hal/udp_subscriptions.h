@@ -0,0 +1,57 @@
+/* udp_subscriptions.h
+ *
+ * This file declares the UDP push subscription module. A client sends
+ * `subscribe [seconds]` (a command it registers with udp_commands.h) and, until its lease runs out, receives the binary
+ * stats and delta encoded history (see udp_protocol.h) of every completed second
+ * as soon as the Sampler rolls it into the history. Clients renew the lease by
+ * subscribing again and leave with `unsubscribe`.
+ *
+ * Each completed second is queued by epoch and published exactly once, in order,
+ * by the UDP listener's event loop, so the sampling thread never waits on the
+ * network.
+ *
+ * With `multicast on [group]` every second is also sent once to a multicast
+ * group (IPv4 or IPv6, port UDP_SUBSCRIPTIONS_MULTICAST_PORT), so any number of
+ * observers can join the group instead of each holding a lease. The default
+ * hop limit of 1 keeps the traffic on the local network.
+ */
+
+#ifndef _UDP_SUBSCRIPTIONS_H_
+#define _UDP_SUBSCRIPTIONS_H_
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#define UDP_SUBSCRIPTIONS_MAX_SUBSCRIBERS 16
+#define UDP_SUBSCRIPTIONS_DEFAULT_LEASE_S 10
+#define UDP_SUBSCRIPTIONS_MAX_LEASE_S 300
+#define UDP_SUBSCRIPTIONS_MULTICAST_GROUP "239.255.43.3"
+#define UDP_SUBSCRIPTIONS_MULTICAST_PORT 12346
+
+// Pushes are sent on the listener's socket `sockfd`.
+void UdpSubscriptions_init(int sockfd);
+void UdpSubscriptions_cleanup(void);
+
+// Add `addr` as a subscriber (or renew its lease) for `leaseSeconds`.
+// Returns false if the subscriber table is full.
+bool UdpSubscriptions_subscribe(const struct sockaddr_in6 *addr, int leaseSeconds);
+
+// Remove `addr`; returns false if it was not subscribed.
+bool UdpSubscriptions_unsubscribe(const struct sockaddr_in6 *addr);
+
+// Also publish to multicast `group` (an IPv4 or IPv6 address), or stop
+// publishing to multicast if `group` is NULL. Returns false if `group` is not
+// a multicast address.
+bool UdpSubscriptions_setMulticast(const char *group);
+
+// Called by the Sampler right after Sampler_moveCurrentDataToHistory() to
+// queue the newly completed second for publishing.
+void UdpSubscriptions_notifyNewHistory(void);
+
+// eventfd that becomes readable when seconds are queued for publishing.
+int UdpSubscriptions_getEventFd(void);
+
+// Publish every queued second, oldest first. Called from the event loop.
+void UdpSubscriptions_publishPending(void);
+
+#endif
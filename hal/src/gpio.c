@@ -8,6 +8,8 @@
 #include <gpiod.h>
 #include <assert.h>
 
+#define EVENT_CONSUMER "light_sampler"
+
 // Relies on the gpiod library.
 // Insallation for cross compiling:
 //      (host)$ sudo dpkg --add-architecture arm64
@@ -78,6 +80,34 @@ struct GpioLine* Gpio_openForEvents(enum eGpioChips chip, int pinNumber)
     return (struct GpioLine*) line;  
 }
 
+// Request both-edge events once; the kernel then queues every edge until it
+// is read, including the ones that happen while nobody is waiting.
+void Gpio_requestEvents(struct GpioLine* line)
+{
+    assert(s_isInitialized);
+    struct gpiod_line* gpiodLine = (struct gpiod_line*) line;
+    if (gpiod_line_is_requested(gpiodLine)) {
+        return;
+    }
+    if (gpiod_line_request_both_edges_events(gpiodLine, EVENT_CONSUMER) == -1) {
+        perror("Unable to request GPIO line events");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int Gpio_getEventFd(struct GpioLine* line)
+{
+    assert(s_isInitialized);
+    return gpiod_line_event_get_fd((struct gpiod_line*) line);
+}
+
+// Returns the number of events read, or -1
+int Gpio_readEvents(struct GpioLine* line, struct gpiod_line_event *events, int maxEvents)
+{
+    assert(s_isInitialized);
+    return gpiod_line_event_read_multiple((struct gpiod_line*) line, events, maxEvents);
+}
+
 void Gpio_close(struct GpioLine* line)
 {
     assert(s_isInitialized);
@@ -98,10 +128,10 @@ int Gpio_waitForLineChange(
     gpiod_line_bulk_init(&bulkWait);
     
     // TODO: Add more lines if needed
+    Gpio_requestEvents(line2); // Only the first wait requests the lines
+    Gpio_requestEvents(line1);
     gpiod_line_bulk_add(&bulkWait, (struct gpiod_line*)line2);
     gpiod_line_bulk_add(&bulkWait, (struct gpiod_line*)line1);
-    
-    gpiod_line_request_bulk_both_edges_events(&bulkWait, "Event Waiting");
 
     struct timespec timeout = { 1, 0 }; // 1 second timeout
     int result = gpiod_line_event_wait_bulk(&bulkWait, &timeout, bulkEvents);
@@ -1,96 +1,334 @@
 /* i2c.c
- * 
- * This file provides initialization, cleanup, and register read/write 
- * operations for I2C communication using the Linux I2C driver. It includes 
- * functions to open an I2C bus, configure it for a specific slave device, 
+ *
+ * This file provides initialization, cleanup, and register read/write
+ * operations for I2C communication using the Linux I2C driver. It includes
+ * functions to open an I2C bus, configure it for a specific slave device,
  * and perform 16-bit register read and write operations.
+ *
+ * I2C_RDWR messages carry the slave address, so every opened bus remembers
+ * the address it was opened for, along with its error counters (atomics, as
+ * they are read from other threads). Entries are only ever appended, and
+ * published by the atomic count, so transfers look them up without a lock.
+ *
+ * Utilisation uses two one-second slots per device, tagged with the second
+ * they count: a transfer adds its time to the slot of the current second
+ * (clearing it first if it still holds an older second), and a reader
+ * reports the slot of the previous second. Devices are meant to have one
+ * writer (their bus thread); concurrent writers only blur the figures.
  */
 
 #include "hal/i2c.h"
+#include "hal/metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <stdbool.h>
-#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define MAX_BUSES 8 // Open fds, one per device
+#define MAX_MESSAGES (2 * I2C_MAX_BATCH)  // A read takes two messages
+#define FIRST_BACKOFF_NS 100000
+#define US_PER_SECOND 1000000LL
+#define MAX_SIMULATORS 4
+#define MAX_PATH_LENGTH 64
+
+typedef struct {
+    char bus[MAX_PATH_LENGTH];
+    int address;
+    I2c_simulatorTransfer_t transfer;
+    void *context;
+} simulator_t;
 
-#define SLEEP 55000
+typedef struct {
+    int fd;
+    uint16_t address;
+    const simulator_t *simulator;     // NULL for hardware
+    atomic_ulong transfers;
+    atomic_ulong errors;
+    atomic_ulong retries;
+    atomic_ulong failures;
+    atomic_ullong bytesWritten;
+    atomic_ullong bytesRead;
+    atomic_ullong busyUs;
+    atomic_ulong maxLatencyUs;
+    atomic_ulong latencyBuckets[I2C_LATENCY_BUCKETS];
+    atomic_llong slotSecond[2];
+    atomic_llong slotBusyUs[2];
+} bus_t;
+
+static const unsigned long latencyBoundsUs[I2C_LATENCY_BUCKETS - 1] = I2C_LATENCY_BOUNDS_US;
 
 static bool isInitialized = false;
+static bus_t buses[MAX_BUSES];
+static atomic_int numBuses = 0;
+static pthread_mutex_t openMutex = PTHREAD_MUTEX_INITIALIZER;
+static simulator_t simulators[MAX_SIMULATORS];
+static int numSimulators = 0;
+
+// Function Prototypes
+static bus_t* findBus(int i2c_file_desc);
+static const simulator_t* findSimulator(const char *bus, int address);
+static bool isTransient(int error);
+static void recordTiming(bus_t *bus, int64_t startUs, int64_t endUs);
+
 
 void I2c_initialize(void) {
+    numBuses = 0;
     isInitialized = true;
 }
 
 void I2c_cleanUp(void) {
+    for (int i = 0; i < numBuses; i++) {
+        close(buses[i].fd);
+    }
+    numBuses = 0;
+    numSimulators = 0;
     isInitialized = false;
 }
 
+void I2c_attachSimulator(const char *bus, int address, I2c_simulatorTransfer_t transfer, void *context) {
+    if (!isInitialized) {
+        perror("Error: Ic2 not initialized!\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&openMutex);
+    if (numSimulators >= MAX_SIMULATORS || strlen(bus) >= MAX_PATH_LENGTH) {
+        fprintf(stderr, "I2C DRV: Unable to attach a simulator to %s 0x%02x\n", bus, address);
+        exit(EXIT_FAILURE);
+    }
+    simulator_t *simulator = &simulators[numSimulators++];
+    strcpy(simulator->bus, bus);
+    simulator->address = address;
+    simulator->transfer = transfer;
+    simulator->context = context;
+    pthread_mutex_unlock(&openMutex);
+}
+
+// Must be called with openMutex held.
+static const simulator_t* findSimulator(const char *bus, int address) {
+    for (int i = 0; i < numSimulators; i++) {
+        if (simulators[i].address == address && strcmp(simulators[i].bus, bus) == 0) {
+            return &simulators[i];
+        }
+    }
+    return NULL;
+}
+
 
 int init_i2c_bus(const char* bus, int address) {
     if (!isInitialized) {
         perror("Error: Ic2 not initialized!\n");
         exit(EXIT_FAILURE);
     }
+    pthread_mutex_lock(&openMutex);
+    if (numBuses >= MAX_BUSES) {
+        pthread_mutex_unlock(&openMutex);
+        return -EMFILE;
+    }
 
-    int i2c_file_desc = open(bus, O_RDWR);
+    // A simulated device still gets a real descriptor, so handles stay unique
+    const simulator_t *simulator = findSimulator(bus, address);
+    int i2c_file_desc = open(simulator ? "/dev/null" : bus, O_RDWR | O_CLOEXEC);
     if (i2c_file_desc == -1) {
-        printf("I2C DRV: Unable to open bus for read/write (%s)\n", bus);
-        perror("Error is:");
-        exit(EXIT_FAILURE);
+        int error = errno;
+        pthread_mutex_unlock(&openMutex);
+        return -error;
     }
 
-    if (ioctl(i2c_file_desc, I2C_SLAVE, address) == -1) {
-        perror("Unable to set I2C device to slave address.");
-        exit(EXIT_FAILURE);
+    // Not needed by I2C_RDWR, but keeps plain read()/write() on the fd working
+    if (!simulator && ioctl(i2c_file_desc, I2C_SLAVE, address) == -1) {
+        int error = errno;
+        close(i2c_file_desc);
+        pthread_mutex_unlock(&openMutex);
+        return -error;
     }
 
+    bus_t *entry = &buses[numBuses];
+    memset(entry, 0, sizeof(*entry)); // Not yet visible to other threads
+    entry->fd = i2c_file_desc;
+    entry->address = address;
+    entry->simulator = simulator;
+    entry->slotSecond[0] = entry->slotSecond[1] = -1;
+    atomic_fetch_add(&numBuses, 1);
+    pthread_mutex_unlock(&openMutex);
     return i2c_file_desc;
 }
 
-void write_i2c_reg16(int i2c_file_desc, uint8_t reg_addr, uint16_t value) {
-    if (!isInitialized) {
-        perror("Error: Ic2 not initialized!\n");
-        exit(EXIT_FAILURE);
+static bus_t* findBus(int i2c_file_desc) {
+    int count = atomic_load(&numBuses);
+    for (int i = 0; i < count; i++) {
+        if (buses[i].fd == i2c_file_desc) {
+            return &buses[i];
+        }
     }
+    return NULL;
+}
 
-    int tx_size = 1 + sizeof(value);
-    uint8_t buff[tx_size];
-    buff[0] = reg_addr;
-    buff[1] = (value & 0xFF);
-    buff[2] = (value & 0xFF00) >> 8;
+// Errors a later attempt can fix; anything else (a bad fd, a bad request)
+// would fail the same way again.
+static bool isTransient(int error) {
+    return error == EIO || error == EREMOTEIO || error == ENXIO
+        || error == ETIMEDOUT || error == EAGAIN || error == EBUSY || error == EINTR;
+}
 
-    int bytes_written = write(i2c_file_desc, buff, tx_size);
-    if (bytes_written != tx_size) {
-        perror("Unable to write i2c register");
-        exit(EXIT_FAILURE);
+static void recordTiming(bus_t *bus, int64_t startUs, int64_t endUs) {
+    unsigned long latencyUs = endUs - startUs;
+    int bucket = 0;
+    while (bucket < I2C_LATENCY_BUCKETS - 1 && latencyUs > latencyBoundsUs[bucket]) {
+        bucket++;
     }
-    struct timespec reqDelay = {0, SLEEP};
-    nanosleep(&reqDelay, (struct timespec *) NULL);
+    atomic_fetch_add_explicit(&bus->latencyBuckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bus->busyUs, latencyUs, memory_order_relaxed);
+    if (latencyUs > atomic_load_explicit(&bus->maxLatencyUs, memory_order_relaxed)) {
+        atomic_store_explicit(&bus->maxLatencyUs, latencyUs, memory_order_relaxed);
+    }
+
+    int64_t second = endUs / US_PER_SECOND;
+    int slot = second % 2;
+    if (atomic_load_explicit(&bus->slotSecond[slot], memory_order_relaxed) != second) {
+        atomic_store_explicit(&bus->slotBusyUs[slot], 0, memory_order_relaxed);
+        atomic_store_explicit(&bus->slotSecond[slot], second, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&bus->slotBusyUs[slot], latencyUs, memory_order_relaxed);
+
+    Metrics_observe(METRICS_I2C_TRANSFER_US, latencyUs);
+    Metrics_add(METRICS_I2C_BUSY_US, latencyUs);
 }
 
-uint16_t read_i2c_reg16(int i2c_file_desc, uint8_t reg_addr) {
+int I2c_transferBatch(int i2c_file_desc, I2c_transfer_t *transfers, int count) {
     if (!isInitialized) {
         perror("Error: Ic2 not initialized!\n");
         exit(EXIT_FAILURE);
     }
+    if (count <= 0 || count > I2C_MAX_BATCH) {
+        return -EINVAL;
+    }
+    bus_t *bus = findBus(i2c_file_desc);
+    if (!bus) {
+        return -EBADF;
+    }
 
-    int bytes_written = write(i2c_file_desc, &reg_addr, sizeof(reg_addr));
-    if (bytes_written != sizeof(reg_addr)) {
-        perror("Unable to write i2c register.");
-        exit(EXIT_FAILURE);
+    struct i2c_msg messages[MAX_MESSAGES];
+    unsigned long long bytesWritten = 0;
+    unsigned long long bytesRead = 0;
+    uint8_t writeBuffers[I2C_MAX_BATCH][1 + sizeof(uint16_t)];
+    uint8_t readBuffers[I2C_MAX_BATCH][sizeof(uint16_t)];
+    int numMessages = 0;
+
+    for (int i = 0; i < count; i++) {
+        writeBuffers[i][0] = transfers[i].reg_addr;
+        messages[numMessages++] = (struct i2c_msg) {
+            .addr = bus->address,
+            .flags = 0,
+            .len = transfers[i].isRead ? 1 : 1 + sizeof(uint16_t),
+            .buf = writeBuffers[i],
+        };
+        bytesWritten += messages[numMessages - 1].len;
+        if (transfers[i].isRead) {
+            // Repeated start, then read back the register just selected
+            messages[numMessages++] = (struct i2c_msg) {
+                .addr = bus->address,
+                .flags = I2C_M_RD,
+                .len = sizeof(uint16_t),
+                .buf = readBuffers[i],
+            };
+            bytesRead += sizeof(uint16_t);
+        } else {
+            writeBuffers[i][1] = (transfers[i].value & 0xFF);
+            writeBuffers[i][2] = (transfers[i].value & 0xFF00) >> 8;
+        }
     }
 
-    uint16_t value = 0;
-    int bytes_read = read(i2c_file_desc, &value, sizeof(value));
-    if (bytes_read != sizeof(value)) {
-        perror("Unable to read i2c register");
-        exit(EXIT_FAILURE);
+    struct i2c_rdwr_ioctl_data data = { .msgs = messages, .nmsgs = numMessages };
+    atomic_fetch_add_explicit(&bus->transfers, 1, memory_order_relaxed);
+    long backoffNs = FIRST_BACKOFF_NS;
+    int error = 0;
+    int64_t startUs = Metrics_nowInUs();
+    for (int attempt = 1; attempt <= I2C_MAX_ATTEMPTS; attempt++) {
+        int result = bus->simulator
+            ? bus->simulator->transfer(bus->simulator->context, messages, numMessages)
+            : ioctl(i2c_file_desc, I2C_RDWR, &data);
+        if (result == numMessages) {
+            error = 0;
+            break;
+        }
+        error = (result < 0) ? errno : EIO;  // A short transfer counts as a bus error
+        atomic_fetch_add_explicit(&bus->errors, 1, memory_order_relaxed);
+        Metrics_add(METRICS_I2C_ERRORS, 1);
+        if (!isTransient(error) || attempt == I2C_MAX_ATTEMPTS) {
+            break;
+        }
+
+        struct timespec reqDelay = {0, backoffNs};
+        nanosleep(&reqDelay, (struct timespec *) NULL);
+        backoffNs *= 2;
+        atomic_fetch_add_explicit(&bus->retries, 1, memory_order_relaxed);
+    }
+    recordTiming(bus, startUs, Metrics_nowInUs());
+    if (error != 0) {
+        atomic_fetch_add_explicit(&bus->failures, 1, memory_order_relaxed);
+        Metrics_add(METRICS_I2C_FAILURES, 1);
+        return -error;
     }
+    atomic_fetch_add_explicit(&bus->bytesWritten, bytesWritten, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bus->bytesRead, bytesRead, memory_order_relaxed);
+    Metrics_add(METRICS_I2C_BYTES, bytesWritten + bytesRead);
 
-    struct timespec reqDelay = {0, SLEEP};
-    nanosleep(&reqDelay, (struct timespec *) NULL);
-    return value;
-}
\ No newline at end of file
+    for (int i = 0; i < count; i++) {
+        if (transfers[i].isRead) {
+            // Bytes in bus order, as read() into a uint16_t would give them
+            memcpy(&transfers[i].value, readBuffers[i], sizeof(uint16_t));
+        }
+    }
+    return 0;
+}
+
+int write_i2c_reg16(int i2c_file_desc, uint8_t reg_addr, uint16_t value) {
+    I2c_transfer_t transfer = { .reg_addr = reg_addr, .isRead = false, .value = value };
+    return I2c_transferBatch(i2c_file_desc, &transfer, 1);
+}
+
+int read_i2c_reg16(int i2c_file_desc, uint8_t reg_addr, uint16_t *value) {
+    I2c_transfer_t transfer = { .reg_addr = reg_addr, .isRead = true };
+    int result = I2c_transferBatch(i2c_file_desc, &transfer, 1);
+    if (result == 0) {
+        *value = transfer.value;
+    }
+    return result;
+}
+
+int I2c_getStats(int i2c_file_desc, I2c_stats_t *stats) {
+    bus_t *bus = findBus(i2c_file_desc);
+    if (!bus) {
+        return -EBADF;
+    }
+    stats->address = bus->address;
+    stats->transfers = atomic_load_explicit(&bus->transfers, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&bus->errors, memory_order_relaxed);
+    stats->retries = atomic_load_explicit(&bus->retries, memory_order_relaxed);
+    stats->failures = atomic_load_explicit(&bus->failures, memory_order_relaxed);
+    stats->bytesWritten = atomic_load_explicit(&bus->bytesWritten, memory_order_relaxed);
+    stats->bytesRead = atomic_load_explicit(&bus->bytesRead, memory_order_relaxed);
+    stats->busyUs = atomic_load_explicit(&bus->busyUs, memory_order_relaxed);
+    stats->maxLatencyUs = atomic_load_explicit(&bus->maxLatencyUs, memory_order_relaxed);
+    for (int i = 0; i < I2C_LATENCY_BUCKETS; i++) {
+        stats->latencyBuckets[i] = atomic_load_explicit(&bus->latencyBuckets[i], memory_order_relaxed);
+    }
+
+    int64_t previousSecond = Metrics_nowInUs() / US_PER_SECOND - 1;
+    int slot = previousSecond % 2;
+    long long busyUs = 0;
+    if (atomic_load_explicit(&bus->slotSecond[slot], memory_order_relaxed) == previousSecond) {
+        busyUs = atomic_load_explicit(&bus->slotBusyUs[slot], memory_order_relaxed);
+    }
+    stats->utilisation = (double)busyUs / US_PER_SECOND;
+    return 0;
+}
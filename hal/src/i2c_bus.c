@@ -0,0 +1,312 @@
+/* i2c_bus.c
+ *
+ * This file implements the I2C bus workers. Every bus has one queue per
+ * priority (singly linked through the requests, so queueing never allocates)
+ * guarded by the bus mutex; the bus thread drops the mutex while it is on the
+ * bus, so submitting never waits for a transaction.
+ */
+
+#include "hal/i2c_bus.h"
+#include "hal/metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_DEVICES 8
+#define MAX_PATH_LENGTH 64
+
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t workAvailable;
+    pthread_cond_t requestDone;
+    I2cBus_request_t *heads[I2C_BUS_PRIORITY_COUNT];
+    I2cBus_request_t *tails[I2C_BUS_PRIORITY_COUNT];
+    bool isStopping;
+} bus_t;
+
+typedef struct {
+    bus_t *bus;
+    int fd;
+} device_t;
+
+static bus_t buses[I2C_BUS_MAX_BUSES];
+static int numBuses = 0;
+static device_t devices[MAX_DEVICES];
+static atomic_int numDevices = 0; // Devices are only appended; submit reads it without a lock
+static bool isInitialized = false;
+static pthread_mutex_t openMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function Prototypes
+static int findOrStartBus(const char *path, bus_t **found);
+static void* busThreadFunc(void *arg);
+static int takeBatch(bus_t *bus, I2cBus_request_t **batch);
+static void runBatch(I2cBus_request_t **batch, int numRequests);
+static void complete(bus_t *bus, I2cBus_request_t **batch, int numRequests);
+
+
+void I2cBus_init(void) {
+    assert(!isInitialized);
+    I2c_initialize();
+    numBuses = 0;
+    numDevices = 0;
+    isInitialized = true;
+}
+
+void I2cBus_cleanup(void) {
+    assert(isInitialized);
+    for (int i = 0; i < numBuses; i++) {
+        bus_t *bus = &buses[i];
+        pthread_mutex_lock(&bus->mutex);
+        bus->isStopping = true;
+        pthread_cond_signal(&bus->workAvailable);
+        pthread_mutex_unlock(&bus->mutex);
+        pthread_join(bus->thread, NULL);
+        pthread_mutex_destroy(&bus->mutex);
+        pthread_cond_destroy(&bus->workAvailable);
+        pthread_cond_destroy(&bus->requestDone);
+    }
+    numBuses = 0;
+    numDevices = 0;
+    I2c_cleanUp();
+    isInitialized = false;
+}
+
+// Returns 0, or -errno if there is no free bus slot or the thread does not
+// start. Must be called with openMutex held.
+static int findOrStartBus(const char *path, bus_t **found) {
+    for (int i = 0; i < numBuses; i++) {
+        if (strcmp(buses[i].path, path) == 0) {
+            *found = &buses[i];
+            return 0;
+        }
+    }
+    if (numBuses >= I2C_BUS_MAX_BUSES) {
+        return -EMFILE;
+    }
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+
+    bus_t *bus = &buses[numBuses];
+    memset(bus, 0, sizeof(*bus));
+    strcpy(bus->path, path);
+    pthread_mutex_init(&bus->mutex, NULL);
+    pthread_cond_init(&bus->workAvailable, NULL);
+    pthread_cond_init(&bus->requestDone, NULL);
+    int error = pthread_create(&bus->thread, NULL, busThreadFunc, bus);
+    if (error != 0) {
+        pthread_mutex_destroy(&bus->mutex);
+        pthread_cond_destroy(&bus->workAvailable);
+        pthread_cond_destroy(&bus->requestDone);
+        return -error;
+    }
+    numBuses++;
+    *found = bus;
+    return 0;
+}
+
+int I2cBus_openDevice(const char *path, int address) {
+    assert(isInitialized);
+    pthread_mutex_lock(&openMutex);
+    if (numDevices >= MAX_DEVICES) {
+        pthread_mutex_unlock(&openMutex);
+        return -EMFILE;
+    }
+
+    // Start the bus first: the driver's table of open fds is append only, so
+    // an fd it has opened cannot be handed back if a later step fails
+    bus_t *bus = NULL;
+    int result = findOrStartBus(path, &bus);
+    if (result < 0) {
+        pthread_mutex_unlock(&openMutex);
+        return result;
+    }
+    int fd = init_i2c_bus(path, address);
+    if (fd < 0) {
+        pthread_mutex_unlock(&openMutex);
+        return fd; // The bus thread stays for the next attempt
+    }
+
+    int device = numDevices;
+    devices[device].bus = bus;
+    devices[device].fd = fd;
+    atomic_store(&numDevices, device + 1);
+    pthread_mutex_unlock(&openMutex);
+    return device;
+}
+
+int I2cBus_submit(I2cBus_request_t *request) {
+    assert(isInitialized);
+    if (request->device < 0 || request->device >= numDevices
+        || request->count <= 0 || request->count > I2C_MAX_BATCH
+        || request->priority >= I2C_BUS_PRIORITY_COUNT) {
+        return -EINVAL;
+    }
+
+    bus_t *bus = devices[request->device].bus;
+    request->isDone = false;
+    request->submittedUs = Metrics_nowInUs();
+    request->next = NULL;
+    pthread_mutex_lock(&bus->mutex);
+    if (bus->tails[request->priority]) {
+        bus->tails[request->priority]->next = request;
+    } else {
+        bus->heads[request->priority] = request;
+    }
+    bus->tails[request->priority] = request;
+    pthread_cond_signal(&bus->workAvailable);
+    pthread_mutex_unlock(&bus->mutex);
+    return 0;
+}
+
+int I2cBus_wait(I2cBus_request_t *request) {
+    assert(!request->callback);
+    bus_t *bus = devices[request->device].bus;
+    pthread_mutex_lock(&bus->mutex);
+    while (!request->isDone) {
+        pthread_cond_wait(&bus->requestDone, &bus->mutex);
+    }
+    pthread_mutex_unlock(&bus->mutex);
+    return request->result;
+}
+
+int I2cBus_transfer(int device, I2c_transfer_t *transfers, int count, I2cBus_priority_t priority) {
+    if (count <= 0 || count > I2C_MAX_BATCH) {
+        return -EINVAL;
+    }
+    I2cBus_request_t request = {
+        .device = device,
+        .count = count,
+        .priority = priority,
+    };
+    memcpy(request.transfers, transfers, count * sizeof(*transfers));
+
+    int result = I2cBus_submit(&request);
+    if (result == 0) {
+        result = I2cBus_wait(&request);
+    }
+    memcpy(transfers, request.transfers, count * sizeof(*transfers));
+    return result;
+}
+
+static void* busThreadFunc(void *arg) {
+    bus_t *bus = arg;
+    I2cBus_request_t *batch[I2C_MAX_BATCH];
+
+    pthread_mutex_lock(&bus->mutex);
+    while (true) {
+        int numRequests = takeBatch(bus, batch);
+        if (numRequests == 0) {
+            if (bus->isStopping) {
+                break; // Only once the queues are empty
+            }
+            pthread_cond_wait(&bus->workAvailable, &bus->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&bus->mutex);
+        int64_t startUs = Metrics_nowInUs();
+        for (int i = 0; i < numRequests; i++) {
+            Metrics_observe(METRICS_I2C_QUEUE_WAIT_US, startUs - batch[i]->submittedUs);
+        }
+        runBatch(batch, numRequests);
+        complete(bus, batch, numRequests);
+        pthread_mutex_lock(&bus->mutex);
+    }
+    pthread_mutex_unlock(&bus->mutex);
+    return NULL;
+}
+
+// Take the next request, plus the ones queued right behind it for the same
+// device while they fit in one transaction. Must be called with the bus mutex held.
+static int takeBatch(bus_t *bus, I2cBus_request_t **batch) {
+    for (int priority = 0; priority < I2C_BUS_PRIORITY_COUNT; priority++) {
+        I2cBus_request_t *request = bus->heads[priority];
+        if (!request) {
+            continue;
+        }
+
+        int numRequests = 0;
+        int numTransfers = 0;
+        int device = request->device;
+        while (request && request->device == device && numTransfers + request->count <= I2C_MAX_BATCH) {
+            batch[numRequests++] = request;
+            numTransfers += request->count;
+            request = request->next;
+        }
+        bus->heads[priority] = request;
+        if (!request) {
+            bus->tails[priority] = NULL;
+        }
+        return numRequests;
+    }
+    return 0;
+}
+
+static void runBatch(I2cBus_request_t **batch, int numRequests) {
+    int fd = devices[batch[0]->device].fd;
+    if (numRequests == 1) {
+        batch[0]->result = I2c_transferBatch(fd, batch[0]->transfers, batch[0]->count);
+        return;
+    }
+
+    // Merge into one transaction, then hand each request its part of the results
+    I2c_transfer_t transfers[I2C_MAX_BATCH];
+    int numTransfers = 0;
+    for (int i = 0; i < numRequests; i++) {
+        memcpy(transfers + numTransfers, batch[i]->transfers, batch[i]->count * sizeof(*transfers));
+        numTransfers += batch[i]->count;
+    }
+    int result = I2c_transferBatch(fd, transfers, numTransfers);
+    numTransfers = 0;
+    for (int i = 0; i < numRequests; i++) {
+        memcpy(batch[i]->transfers, transfers + numTransfers, batch[i]->count * sizeof(*transfers));
+        numTransfers += batch[i]->count;
+        batch[i]->result = result;
+    }
+}
+
+// Callbacks run without the bus mutex, so they may submit follow-up requests
+static void complete(bus_t *bus, I2cBus_request_t **batch, int numRequests) {
+    I2cBus_request_t *waited[I2C_MAX_BATCH];
+    int numWaited = 0;
+    for (int i = 0; i < numRequests; i++) {
+        if (batch[i]->callback) {
+            batch[i]->callback(batch[i]); // The request belongs to the caller again
+        } else {
+            waited[numWaited++] = batch[i];
+        }
+    }
+    if (numWaited == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&bus->mutex);
+    for (int i = 0; i < numWaited; i++) {
+        waited[i]->isDone = true;
+    }
+    pthread_cond_broadcast(&bus->requestDone);
+    pthread_mutex_unlock(&bus->mutex);
+}
+
+int I2cBus_getNumDevices(void) {
+    return atomic_load(&numDevices);
+}
+
+const char* I2cBus_getPath(int device) {
+    assert(device >= 0 && device < numDevices);
+    return devices[device].bus->path;
+}
+
+int I2cBus_getStats(int device, I2c_stats_t *stats) {
+    if (device < 0 || device >= numDevices) {
+        return -EINVAL;
+    }
+    return I2c_getStats(devices[device].fd, stats);
+}
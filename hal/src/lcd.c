@@ -1,58 +1,124 @@
 /* lcd.c
 * LCD module starts thread that updates the screen with the current frequency, dip count and max time every second.
+* A redraw sends the whole frame over SPI, so it runs on its own thread instead of delaying the UDP event loop.
+* The thread waits on a condition variable until the next deadline, so a new lcd_refresh_ms or shutdown wakes it at once.
 */
 
 #include <stdio.h>		//printf()
 #include <stdlib.h>		//exit()
 #include <signal.h>     //signal()
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <updateLcd.h>
 #include <hal/pwm_rotary.h>
 #include <hal/light_sensor.h>
 #include "hal/udp_listener.h"
+#include "hal/params.h"
 
 
 #define BUFFER_SIZE 100
+#define NS_PER_MS 1000000LL
+#define NS_PER_SECOND 1000000000LL
 
 static bool isInitialized = false;
+static bool isHeadless = false;     // adc_simulated: run without the display
 static pthread_t lcdThread;
-// static volatile bool lcdRunning = true;
+static pthread_mutex_t lcdMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lcdWakeUp;
+static bool isStopping = false;
+static bool isPeriodChanged = false;
 
-static void *lcd_thread(void* arg) {
-    (void)arg;
-    while(UdpListener_isRunning()){
-        char hz[BUFFER_SIZE], dips[BUFFER_SIZE], ms[BUFFER_SIZE];
+static void lcd_refresh(void) {
+    char hz[BUFFER_SIZE], dips[BUFFER_SIZE], ms[BUFFER_SIZE];
 
-        snprintf(hz, sizeof(hz), "%dHz", PwmRotary_getFrequency()); 
-        snprintf(dips, sizeof(dips), "%d", Sampler_getDipCount());  
-        snprintf(ms, sizeof(ms), "%.2f", Sampler_getMaxTime());
+    snprintf(hz, sizeof(hz), "%dHz", PwmRotary_getFrequency()); 
+    snprintf(dips, sizeof(dips), "%d", Sampler_getDipCount());  
+    snprintf(ms, sizeof(ms), "%.2f", Sampler_getMaxTime());
 
-        UpdateLcd_updateScreen(hz, dips, ms);
+    UpdateLcd_updateScreen(hz, dips, ms);
+}
 
-        sleep(1);
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
 
+static void *lcd_thread(void* arg) {
+    (void)arg;
+    int64_t deadlineNs = now_ns();
+    pthread_mutex_lock(&lcdMutex);
+    while (!isStopping && UdpListener_isRunning()) {
+        if (isPeriodChanged) {
+            isPeriodChanged = false;
+            deadlineNs = now_ns();
+        }
+        if (now_ns() >= deadlineNs) {
+            pthread_mutex_unlock(&lcdMutex);
+            lcd_refresh();
+            pthread_mutex_lock(&lcdMutex);
+            // Next deadline from the last one, so the refresh time does not add up
+            deadlineNs += Params_getInt(PARAMS_LCD_REFRESH_MS) * NS_PER_MS;
+            if (deadlineNs < now_ns()) {
+                deadlineNs = now_ns(); // Fell behind (slow redraw): don't try to catch up
+            }
+            continue;
+        }
+        struct timespec deadline = { deadlineNs / NS_PER_SECOND, deadlineNs % NS_PER_SECOND };
+        pthread_cond_timedwait(&lcdWakeUp, &lcdMutex, &deadline);
     }
+    pthread_mutex_unlock(&lcdMutex);
     return NULL;
 }
 
+// Redraw now and restart the period, so a shorter period applies at once
+static void onRefreshPeriodChanged(enum Params_id id) {
+    (void)id;
+    pthread_mutex_lock(&lcdMutex);
+    isPeriodChanged = true;
+    pthread_cond_signal(&lcdWakeUp);
+    pthread_mutex_unlock(&lcdMutex);
+}
+
 
 void Lcd_init()
 {
     assert(!isInitialized);
+    isHeadless = Params_getBool(PARAMS_ADC_SIMULATED);
+    if (isHeadless) {
+        isInitialized = true;
+        return;
+    }
     
     // Module Init
 	UpdateLcd_init();
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lcdWakeUp, &attr);
+    pthread_condattr_destroy(&attr);
+    isStopping = false;
     pthread_create(&lcdThread, NULL, &lcd_thread, NULL);
     isInitialized = true;
+    Params_onChange(PARAMS_LCD_REFRESH_MS, onRefreshPeriodChanged);
 }
 void Lcd_cleanup()
 {
     assert(isInitialized);
-    // lcdRunning = false;
+    if (isHeadless) {
+        isInitialized = false;
+        return;
+    }
+    pthread_mutex_lock(&lcdMutex);
+    isStopping = true;
+    pthread_cond_signal(&lcdWakeUp);
+    pthread_mutex_unlock(&lcdMutex);
     pthread_join(lcdThread, NULL);
+    pthread_cond_destroy(&lcdWakeUp);
     UpdateLcd_cleanup();
     isInitialized = false;
 }
\ No newline at end of file
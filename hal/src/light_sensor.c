@@ -6,29 +6,30 @@
  */
 
 #include "hal/light_sensor.h"
-#include "hal/i2c.h"
+#include "hal/i2c_bus.h"
+#include "hal/tla2024_sim.h"
 #include "hal/periodTimer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "hal/pwm_rotary.h"
 #include "hal/udp_listener.h"
+#include "hal/udp_subscriptions.h"
+#include "hal/metrics.h"
+#include "hal/params.h"
 
-#define NS_SLEEP 1000000
 #define I2CDRV_LINUX_BUS "/dev/i2c-1"
 #define I2C_DEVICE_ADDRESS 0x48 // ADC chip
 #define REG_CONFIGURATION 0x01
 #define REG_DATA 0x00
 #define TLA2024_CHANNEL_CONF_2 0x83E2 // Configuration for light sensor
-#define MAX_HISTORY_SIZE 1200 // Maximum samples stored per second
-#define SMOOTHING_FACTOR 0.001 // 0.1% new sample, 99.9% previous average
 #define VOLTAGE_CONVERSION_FACTOR (3.3 / 4096)
-#define DIP_THRESHOLD 0.1  // 0.1V drop to trigger a dip
-#define HYSTERESIS 0.03  // 0.07V rise needed before another dip
 #define MAX_DISPLAY_SAMPLES 10 //print 10 samples every second
 
 static double currentSamples[MAX_HISTORY_SIZE];
@@ -42,8 +43,15 @@ static int dipCount = 0;
 static double lastVoltage = 0.0;
 static bool belowThreshold = false;
 static double maxPeriod = 0.0;
-
-static int i2c_file_desc = -1;
+static Period_statistics_t lastPeriodStats;
+static atomic_uint historyEpoch = 0; // Read without sampleMutex by the reply cache
+
+static int adcDevice = -1;          // -1 until the bus opens; the sampler retries every second
+static bool isAdcFailing = false;   // Sampler thread only: report failures once, not every sample
+static int currentGapCount = 0;     // Samples missed this second
+static int historyGapCount = 0;     // Samples missed in the previous complete second
+static int currentDroppedCount = 0; // Samples this second that did not fit in MAX_HISTORY_SIZE
+static int historyDroppedCount = 0;
 static bool isInitialized = false;
 static pthread_t samplerThread;
 // static bool keepSampling = true;
@@ -52,7 +60,7 @@ static pthread_mutex_t sampleMutex = PTHREAD_MUTEX_INITIALIZER;
 // Function Prototypes
 void Sampler_init(void);
 void Sampler_cleanup(void);
-double Sampler_getReading(void);
+bool Sampler_getReading(double *reading);
 void Sampler_moveCurrentDataToHistory(void);
 int Sampler_getHistorySize(void);
 double* Sampler_getHistory(int *size);
@@ -62,6 +70,8 @@ int Sampler_getDipCount(void);
 static void* samplerThreadFunc(void* arg);
 static void Sampler_detectDips(void);
 static void PrintStatistics(void);
+static void openAdcBus(void);
+static void recordGap(int error);
 
 
 static void* samplerThreadFunc(void* arg) {
@@ -70,11 +80,14 @@ static void* samplerThreadFunc(void* arg) {
         static struct timespec lastMoveTime = {0, 0};  
         struct timespec currentTime;
         
-        Sampler_getReading();
-        Period_markEvent(PERIOD_EVENT_SAMPLE_LIGHT);
+        double reading;
+        if (Sampler_getReading(&reading)) {
+            Period_markEvent(PERIOD_EVENT_SAMPLE_LIGHT);
+        }
 
-        // Sleep for 1ms
-        struct timespec reqDelay = {0, NS_SLEEP}; 
+        // Sleep for the sample period (1ms by default)
+        long sleepNs = Params_getInt(PARAMS_SAMPLE_PERIOD_US) * 1000L;
+        struct timespec reqDelay = {sleepNs / 1000000000L, sleepNs % 1000000000L};
         nanosleep(&reqDelay, NULL);
 
         // Get current time
@@ -85,9 +98,13 @@ static void* samplerThreadFunc(void* arg) {
         long diffNano = currentTime.tv_nsec - lastMoveTime.tv_nsec;
         
         if (diffSec > 1 || (diffSec == 1 && diffNano >= 0)) {
+            if (adcDevice < 0) {
+                openAdcBus();
+            }
             PrintStatistics();
             Sampler_detectDips();
             Sampler_moveCurrentDataToHistory();
+            UdpSubscriptions_notifyNewHistory();
             lastMoveTime = currentTime; // Update last move time
         }
     }
@@ -107,6 +124,28 @@ static void PrintStatistics(void) {
     Period_getStatisticsAndClear(PERIOD_EVENT_SAMPLE_LIGHT, &stats);
 
     maxPeriod = stats.maxPeriodInMs;
+    pthread_mutex_lock(&sampleMutex);
+    lastPeriodStats = stats;
+    pthread_mutex_unlock(&sampleMutex);
+
+    Metrics_set(METRICS_SAMPLES_LAST_SECOND, currentSampleCount);
+    Metrics_set(METRICS_DIPS_LAST_SECOND, dipCount);
+    Metrics_set(METRICS_AVERAGE_MILLIVOLTS, (int64_t)(avgVoltage * 1000.0 + 0.5));
+    Metrics_set(METRICS_PWM_FREQUENCY_HZ, PwmRotary_getFrequency());
+    Metrics_set(METRICS_SAMPLE_PERIOD_MIN_US, (int64_t)(stats.minPeriodInMs * 1000.0));
+    Metrics_set(METRICS_SAMPLE_PERIOD_MAX_US, (int64_t)(stats.maxPeriodInMs * 1000.0));
+    Metrics_set(METRICS_SAMPLE_PERIOD_AVG_US, (int64_t)(stats.avgPeriodInMs * 1000.0));
+
+    if (!Params_getBool(PARAMS_PRINT_STATISTICS)) {
+        free(history);
+        return;
+    }
+    if (historyGapCount > 0) {
+        printf("Missed %d samples: the light sensor could not be read\n", historyGapCount);
+    }
+    if (historyDroppedCount > 0) {
+        printf("Dropped %d samples: the history holds %d per second\n", historyDroppedCount, MAX_HISTORY_SIZE);
+    }
 
     printf("#Smpl/s = %-4d   Flash @%3dHz   avg = %.3fV   dips = %-3d   Smpl ms[%4.3f, %4.3f] avg %4.3f/%d\n",
            currentSampleCount,  // Sample rate /sec
@@ -136,11 +175,17 @@ static void PrintStatistics(void) {
 void Sampler_init(void) {
     assert(!isInitialized);
     Period_init();
-    I2c_initialize();
     PwmRotary_init();
-    i2c_file_desc = init_i2c_bus(I2CDRV_LINUX_BUS, I2C_DEVICE_ADDRESS);
+    if (Params_getBool(PARAMS_ADC_SIMULATED)) {
+        Tla2024Sim_attach(I2CDRV_LINUX_BUS, I2C_DEVICE_ADDRESS);
+    }
+    openAdcBus();
     currentSampleCount = 0; //Initliaze all values to 0;
     historySampleCount = 0;
+    currentGapCount = 0;
+    historyGapCount = 0;
+    currentDroppedCount = 0;
+    historyDroppedCount = 0;
     totalSamplesTaken = 0;
     // keepSampling = true;
     isInitialized = true;
@@ -152,41 +197,89 @@ void Sampler_cleanup(void) {
     assert(isInitialized);
     // keepSampling = false;
     pthread_join(samplerThread, NULL);
-    I2c_cleanUp();
     Period_cleanup();
     PwmRotary_cleanup();
     isInitialized = false;
 }
 
-double Sampler_getReading() {
+// A failed bus open is not fatal: samples are counted as gaps until it opens.
+// Reported once; the first good read after it opens reports the recovery.
+static void openAdcBus(void) {
+    adcDevice = I2cBus_openDevice(I2CDRV_LINUX_BUS, I2C_DEVICE_ADDRESS);
+    if (adcDevice < 0) {
+        if (!isAdcFailing) {
+            fprintf(stderr, "Light sensor: unable to open the ADC (%s), retrying every second\n", strerror(-adcDevice));
+        }
+        isAdcFailing = true;
+    }
+}
+
+// Record a missed sample; the history simply has fewer samples that second
+static void recordGap(int error) {
+    if (!isAdcFailing && error != -EBADF) {
+        fprintf(stderr, "Light sensor: ADC read failed (%s), marking gaps until it recovers\n", strerror(-error));
+    }
+    isAdcFailing = true;
+    pthread_mutex_lock(&sampleMutex);
+    currentGapCount++;
+    pthread_mutex_unlock(&sampleMutex);
+    Metrics_add(METRICS_SAMPLE_GAPS, 1);
+}
+
+bool Sampler_getReading(double *reading) {
     if (!isInitialized) {
         fprintf(stderr, "Error: LightSensor not initialized! 8\n");
         exit(EXIT_FAILURE);
     }
 
-    write_i2c_reg16(i2c_file_desc, REG_CONFIGURATION, TLA2024_CHANNEL_CONF_2);
-    uint16_t raw_value = read_i2c_reg16(i2c_file_desc, REG_DATA);
+    // Select the channel and read the conversion in one bus transaction
+    I2c_transfer_t transfers[] = {
+        { .reg_addr = REG_CONFIGURATION, .isRead = false, .value = TLA2024_CHANNEL_CONF_2 },
+        { .reg_addr = REG_DATA, .isRead = true },
+    };
+    int result = (adcDevice < 0) ? -EBADF
+        : I2cBus_transfer(adcDevice, transfers, 2, I2C_BUS_PRIORITY_SAMPLING);
+    if (result < 0) {
+        recordGap(result);
+        return false;
+    }
+    if (isAdcFailing) {
+        fprintf(stderr, "Light sensor: ADC reads recovered\n");
+        isAdcFailing = false;
+    }
+
+    uint16_t raw_value = transfers[1].value;
     uint16_t shifted_value = ((raw_value & 0xFF00) >> 8 | (raw_value & 0x00FF) << 8) >> 4;
-    double reading = (double)shifted_value;
-    // printf("Sensor current: %f\n", reading);
+    *reading = (double)shifted_value;
+    // printf("Sensor current: %f\n", *reading);
 
     pthread_mutex_lock(&sampleMutex);
     // Update the exponential moving average
     if (isFirstSample) {
-        smoothedAverage = reading;
+        smoothedAverage = *reading;
         isFirstSample = false;
     } else {
-        smoothedAverage = (SMOOTHING_FACTOR * reading) + ((1.0 - SMOOTHING_FACTOR) * smoothedAverage);
+        double smoothing = Params_getDouble(PARAMS_SMOOTHING_FACTOR);
+        smoothedAverage = (smoothing * *reading) + ((1.0 - smoothing) * smoothedAverage);
     }
 
     // Store the sample
-    if (currentSampleCount < MAX_HISTORY_SIZE) {
-        currentSamples[currentSampleCount++] = reading;
+    // sample_period_us keeps a second under MAX_HISTORY_SIZE; a longer window
+    // (e.g. a late statistics pass) still counts what does not fit
+    bool isStored = currentSampleCount < MAX_HISTORY_SIZE;
+    if (isStored) {
+        currentSamples[currentSampleCount++] = *reading;
+    } else {
+        currentDroppedCount++;
     }
     totalSamplesTaken++;
     pthread_mutex_unlock(&sampleMutex);
+    Metrics_add(METRICS_SAMPLES_TOTAL, 1);
+    if (!isStored) {
+        Metrics_add(METRICS_SAMPLES_DROPPED, 1);
+    }
 
-    return reading;
+    return true;
 }
 
 void Sampler_moveCurrentDataToHistory(void) {
@@ -198,6 +291,11 @@ void Sampler_moveCurrentDataToHistory(void) {
     memcpy(historySamples, currentSamples, currentSampleCount * sizeof(double));
     historySampleCount = currentSampleCount;
     currentSampleCount = 0;
+    historyGapCount = currentGapCount;
+    currentGapCount = 0;
+    historyDroppedCount = currentDroppedCount;
+    currentDroppedCount = 0;
+    historyEpoch++;
     pthread_mutex_unlock(&sampleMutex);
 }
 
@@ -234,6 +332,29 @@ double* Sampler_getHistory(int *size) {
     return copy; // Caller must free this
 }
 
+int Sampler_getHistoryRaw(uint16_t *samples, int maxSize, uint32_t *epoch) {
+    assert(isInitialized);
+
+    pthread_mutex_lock(&sampleMutex);
+    int count = historySampleCount < maxSize ? historySampleCount : maxSize;
+    for (int i = 0; i < count; i++) {
+        samples[i] = (uint16_t)historySamples[i];
+    }
+    if (epoch) {
+        *epoch = historyEpoch;
+    }
+    pthread_mutex_unlock(&sampleMutex);
+
+    return count;
+}
+
+uint32_t Sampler_getHistoryEpoch(void) {
+    assert(isInitialized);
+    // Lock free: checked on every cached reply, while the sampler holds
+    // sampleMutex once per millisecond
+    return atomic_load(&historyEpoch);
+}
+
 double Sampler_getAverageReading(void) {
      if (!isInitialized) {
         fprintf(stderr, "Error: LightSensor not initialized! 4\n");
@@ -260,10 +381,13 @@ static void Sampler_detectDips(void) {
 
     pthread_mutex_lock(&sampleMutex);
     dipCount = 0; // Reset dip count for this second
+    // Drop below the average that triggers a dip, and the rise needed before another
+    double dipThreshold = Params_getDouble(PARAMS_DIP_THRESHOLD_V);
+    double hysteresis = Params_getDouble(PARAMS_DIP_HYSTERESIS_V);
     for (int i = 0; i < historySampleCount; i++) {
         double voltage = VOLTAGE_CONVERSION_FACTOR * historySamples[i];
-        double threshold = smoothedAverage * VOLTAGE_CONVERSION_FACTOR - DIP_THRESHOLD;
-        double resetThreshold = smoothedAverage * VOLTAGE_CONVERSION_FACTOR - (DIP_THRESHOLD - HYSTERESIS);
+        double threshold = smoothedAverage * VOLTAGE_CONVERSION_FACTOR - dipThreshold;
+        double resetThreshold = smoothedAverage * VOLTAGE_CONVERSION_FACTOR - (dipThreshold - hysteresis);
 
         if (!belowThreshold && voltage < threshold) {
             dipCount++;
@@ -288,7 +412,22 @@ int Sampler_getDipCount(void) {
     return dipCount;
 }
 
+int Sampler_getGapCount(void) {
+    assert(isInitialized);
+    pthread_mutex_lock(&sampleMutex);
+    int gaps = historyGapCount;
+    pthread_mutex_unlock(&sampleMutex);
+    return gaps;
+}
+
 double Sampler_getMaxTime(void){
     assert(isInitialized);
     return maxPeriod;
 }
+
+void Sampler_getPeriodStatistics(Period_statistics_t *pStats) {
+    assert(isInitialized);
+    pthread_mutex_lock(&sampleMutex);
+    *pStats = lastPeriodStats;
+    pthread_mutex_unlock(&sampleMutex);
+}
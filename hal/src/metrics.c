@@ -0,0 +1,172 @@
+/* metrics.c
+ *
+ * This file implements the metrics registry with one relaxed atomic per value
+ * and per histogram bucket. Histograms use fixed microsecond bucket bounds and
+ * are exposed cumulatively, as Prometheus expects.
+ */
+
+#include "hal/metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <assert.h>
+
+#define NUM_BUCKETS 10 // Plus the implicit +Inf bucket
+
+typedef enum {
+    TYPE_COUNTER,
+    TYPE_GAUGE,
+} metricType_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    metricType_t type;
+    int64_t divisor;   // Stored value / divisor = value in base units
+} metricInfo_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+} histogramInfo_t;
+
+typedef struct {
+    atomic_llong buckets[NUM_BUCKETS + 1];
+    atomic_llong sumUs;
+    atomic_llong count;
+} histogram_t;
+
+static const metricInfo_t metricInfo[METRICS_COUNT] = {
+    [METRICS_SAMPLES_TOTAL] = { "light_sampler_samples_total", "Light samples taken since start.", TYPE_COUNTER, 1 },
+    [METRICS_SAMPLES_LAST_SECOND] = { "light_sampler_samples_last_second", "Light samples taken in the previously completed second.", TYPE_GAUGE, 1 },
+    [METRICS_DIPS_LAST_SECOND] = { "light_sampler_dips_last_second", "Dips detected in the previously completed second.", TYPE_GAUGE, 1 },
+    [METRICS_AVERAGE_MILLIVOLTS] = { "light_sampler_average_volts", "Exponential moving average of the light sensor voltage.", TYPE_GAUGE, 1000 },
+    [METRICS_PWM_FREQUENCY_HZ] = { "light_sampler_pwm_frequency_hertz", "Flash frequency of the PWM LED.", TYPE_GAUGE, 1 },
+    [METRICS_SAMPLE_PERIOD_MIN_US] = { "light_sampler_sample_period_min_seconds", "Shortest time between samples in the previously completed second.", TYPE_GAUGE, 1000000 },
+    [METRICS_SAMPLE_PERIOD_MAX_US] = { "light_sampler_sample_period_max_seconds", "Longest time between samples in the previously completed second.", TYPE_GAUGE, 1000000 },
+    [METRICS_SAMPLE_PERIOD_AVG_US] = { "light_sampler_sample_period_avg_seconds", "Average time between samples in the previously completed second.", TYPE_GAUGE, 1000000 },
+    [METRICS_SAMPLE_GAPS] = { "light_sampler_sample_gaps_total", "Light samples missed because the ADC could not be read.", TYPE_COUNTER, 1 },
+    [METRICS_SAMPLES_DROPPED] = { "light_sampler_samples_dropped_total", "Light samples taken but left out of the history because a second held more than it stores.", TYPE_COUNTER, 1 },
+    [METRICS_I2C_ERRORS] = { "light_sampler_i2c_errors_total", "Failed I2C transfer attempts, including retried ones.", TYPE_COUNTER, 1 },
+    [METRICS_I2C_FAILURES] = { "light_sampler_i2c_failures_total", "I2C transfers that failed after every retry.", TYPE_COUNTER, 1 },
+    [METRICS_I2C_BYTES] = { "light_sampler_i2c_bytes_total", "Bytes moved by successful I2C transfers.", TYPE_COUNTER, 1 },
+    [METRICS_I2C_BUSY_US] = { "light_sampler_i2c_busy_seconds_total", "Time spent on I2C transfers; its rate is the bus utilisation.", TYPE_COUNTER, 1000000 },
+    [METRICS_UDP_REQUESTS] = { "light_sampler_udp_requests_total", "UDP requests handled.", TYPE_COUNTER, 1 },
+    [METRICS_UDP_RATE_LIMITED] = { "light_sampler_udp_rate_limited_total", "UDP requests dropped by the per-client rate limit.", TYPE_COUNTER, 1 },
+    [METRICS_UDP_QUEUE_FULL] = { "light_sampler_udp_queue_full_total", "UDP requests dropped because every worker was busy.", TYPE_COUNTER, 1 },
+    [METRICS_UDP_CACHE_HITS] = { "light_sampler_udp_reply_cache_hits_total", "UDP replies sent from the reply cache.", TYPE_COUNTER, 1 },
+    [METRICS_UDP_CACHE_MISSES] = { "light_sampler_udp_reply_cache_misses_total", "UDP replies built for the reply cache.", TYPE_COUNTER, 1 },
+};
+
+static const histogramInfo_t histogramInfo[METRICS_HISTOGRAM_COUNT] = {
+    [METRICS_UDP_QUEUE_WAIT_US] = { "light_sampler_udp_queue_wait_seconds", "Time UDP requests wait for a worker thread." },
+    [METRICS_UDP_HANDLE_US] = { "light_sampler_udp_handle_seconds", "Time a worker thread takes to handle a UDP request." },
+    [METRICS_I2C_QUEUE_WAIT_US] = { "light_sampler_i2c_queue_wait_seconds", "Time I2C requests wait for their bus thread." },
+    [METRICS_I2C_TRANSFER_US] = { "light_sampler_i2c_transfer_seconds", "Time an I2C transaction takes, retries included." },
+};
+
+static const int64_t bucketBoundsUs[NUM_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000
+};
+
+static atomic_llong values[METRICS_COUNT];
+static histogram_t histograms[METRICS_HISTOGRAM_COUNT];
+
+// Function Prototypes
+static size_t append(char *buffer, size_t size, size_t offset, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+
+void Metrics_add(enum Metrics_id id, int64_t delta) {
+    assert(id < METRICS_COUNT);
+    atomic_fetch_add_explicit(&values[id], delta, memory_order_relaxed);
+}
+
+void Metrics_set(enum Metrics_id id, int64_t value) {
+    assert(id < METRICS_COUNT);
+    atomic_store_explicit(&values[id], value, memory_order_relaxed);
+}
+
+int64_t Metrics_get(enum Metrics_id id) {
+    assert(id < METRICS_COUNT);
+    return atomic_load_explicit(&values[id], memory_order_relaxed);
+}
+
+void Metrics_observe(enum Metrics_histogramId id, int64_t us) {
+    assert(id < METRICS_HISTOGRAM_COUNT);
+    histogram_t *histogram = &histograms[id];
+
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS && us > bucketBoundsUs[bucket]) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sumUs, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+}
+
+int64_t Metrics_nowInUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static size_t append(char *buffer, size_t size, size_t offset, const char *format, ...) {
+    if (offset >= size) {
+        return offset;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + offset, size - offset, format, args);
+    va_end(args);
+    if (written < 0) {
+        return offset;
+    }
+    return (offset + written < size) ? offset + written : size - 1;
+}
+
+size_t Metrics_formatPrometheus(char *buffer, size_t size) {
+    assert(size > 0);
+    size_t offset = 0;
+    buffer[0] = '\0';
+
+    for (int i = 0; i < METRICS_COUNT; i++) {
+        const metricInfo_t *info = &metricInfo[i];
+        int64_t value = Metrics_get(i);
+        offset = append(buffer, size, offset, "# HELP %s %s\n# TYPE %s %s\n",
+            info->name, info->help, info->name, info->type == TYPE_COUNTER ? "counter" : "gauge");
+        if (info->divisor == 1) {
+            offset = append(buffer, size, offset, "%s %lld\n", info->name, (long long)value);
+        } else {
+            offset = append(buffer, size, offset, "%s %.6f\n", info->name, (double)value / info->divisor);
+        }
+    }
+
+    for (int i = 0; i < METRICS_HISTOGRAM_COUNT; i++) {
+        const histogramInfo_t *info = &histogramInfo[i];
+        histogram_t *histogram = &histograms[i];
+        offset = append(buffer, size, offset, "# HELP %s %s\n# TYPE %s histogram\n",
+            info->name, info->help, info->name);
+
+        // Buckets are read one by one while others update them, so make the
+        // exposed values consistent: cumulative and never above the count
+        long long cumulative = 0;
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            cumulative += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+            offset = append(buffer, size, offset, "%s_bucket{le=\"%g\"} %lld\n",
+                info->name, bucketBoundsUs[b] / 1e6, cumulative);
+        }
+        cumulative += atomic_load_explicit(&histogram->buckets[NUM_BUCKETS], memory_order_relaxed);
+        long long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        if (count < cumulative) {
+            count = cumulative;
+        }
+        offset = append(buffer, size, offset, "%s_bucket{le=\"+Inf\"} %lld\n", info->name, count);
+        offset = append(buffer, size, offset, "%s_sum %.6f\n", info->name,
+            atomic_load_explicit(&histogram->sumUs, memory_order_relaxed) / 1e6);
+        offset = append(buffer, size, offset, "%s_count %lld\n", info->name, count);
+    }
+
+    return offset;
+}
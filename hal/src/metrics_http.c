@@ -0,0 +1,291 @@
+/* metrics_http.c
+ *
+ * This file implements the metrics HTTP server. Each connection owns a fixed
+ * request and response buffer; a request that does not fit, or a client that
+ * stays idle past CONNECTION_TIMEOUT_US, gets its connection closed. Only
+ * `GET /metrics` is served.
+ */
+
+#define _GNU_SOURCE // accept4()
+#include "hal/metrics_http.h"
+#include "hal/metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define REQUEST_BUFFER_SIZE 1024
+#define RESPONSE_BUFFER_SIZE 16384
+#define HEADER_ROOM 256              // Reserved in front of the body for the headers
+#define CONNECTION_TIMEOUT_US 5000000
+#define LISTEN_BACKLOG 8
+#define MAX_EPOLL_EVENTS 8
+#define EPOLL_TIMEOUT_MS 1000        // How often idle connections are checked
+
+// epoll data tags; connections use their index
+enum {
+    EVENT_LISTEN = METRICS_HTTP_MAX_CONNECTIONS,
+    EVENT_STOP,
+};
+
+typedef struct {
+    int fd;                          // -1 when the slot is free
+    int64_t deadlineUs;
+    size_t requestLength;
+    char request[REQUEST_BUFFER_SIZE];
+    size_t responseLength;
+    size_t responseSent;
+    char response[RESPONSE_BUFFER_SIZE];
+} connection_t;
+
+static connection_t connections[METRICS_HTTP_MAX_CONNECTIONS];
+static int listenFd = -1;
+static int epollFd = -1;
+static int stopEventFd = -1;
+static pthread_t metricsThread;
+static bool isInitialized = false;
+
+// Function Prototypes
+static void* metricsThreadFunc(void* arg);
+static void acceptConnections(void);
+static void readRequest(connection_t *conn);
+static void buildResponse(connection_t *conn);
+static void writeResponse(connection_t *conn);
+static void closeConnection(connection_t *conn);
+static void closeIdleConnections(void);
+
+
+void MetricsHttp_init(void) {
+    assert(!isInitialized);
+    for (int i = 0; i < METRICS_HTTP_MAX_CONNECTIONS; i++) {
+        connections[i].fd = -1;
+    }
+
+    // Dual stack, like the UDP socket: IPv4 clients arrive as IPv4-mapped addresses
+    listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        perror("Metrics socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    int v6Only = 0;
+    if (setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only)) < 0) {
+        perror("Unable to enable IPv4 on the metrics socket");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(METRICS_HTTP_PORT);
+    if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, LISTEN_BACKLOG) < 0) {
+        perror("Metrics bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    stopEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (stopEventFd < 0 || epollFd < 0) {
+        perror("Unable to create metrics event loop");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = EVENT_LISTEN };
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.u32 = EVENT_STOP;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, stopEventFd, &event);
+
+    isInitialized = true;
+    pthread_create(&metricsThread, NULL, metricsThreadFunc, NULL);
+}
+
+void MetricsHttp_cleanup(void) {
+    assert(isInitialized);
+    uint64_t one = 1;
+    if (write(stopEventFd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Unable to signal metrics stop");
+    }
+    pthread_join(metricsThread, NULL);
+
+    for (int i = 0; i < METRICS_HTTP_MAX_CONNECTIONS; i++) {
+        if (connections[i].fd >= 0) {
+            closeConnection(&connections[i]);
+        }
+    }
+    close(epollFd);
+    close(stopEventFd);
+    close(listenFd);
+    isInitialized = false;
+}
+
+static void* metricsThreadFunc(void* arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (true) {
+        int numEvents = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, EPOLL_TIMEOUT_MS);
+        if (numEvents < 0) {
+            if (errno == EINTR) continue;
+            perror("Metrics epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < numEvents; i++) {
+            uint32_t tag = events[i].data.u32;
+            if (tag == EVENT_STOP) {
+                return NULL;
+            } else if (tag == EVENT_LISTEN) {
+                acceptConnections();
+            } else if (connections[tag].fd >= 0) {
+                connection_t *conn = &connections[tag];
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    closeConnection(conn);
+                } else if (events[i].events & EPOLLIN) {
+                    readRequest(conn);
+                } else if (events[i].events & EPOLLOUT) {
+                    writeResponse(conn);
+                }
+            }
+        }
+        closeIdleConnections();
+    }
+    return NULL;
+}
+
+static void acceptConnections(void) {
+    while (true) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Metrics accept failed");
+            }
+            return;
+        }
+
+        int slot = -1;
+        for (int i = 0; i < METRICS_HTTP_MAX_CONNECTIONS && slot < 0; i++) {
+            if (connections[i].fd < 0) {
+                slot = i;
+            }
+        }
+        if (slot < 0) {
+            close(fd); // All slots busy; the scraper retries
+            continue;
+        }
+
+        connection_t *conn = &connections[slot];
+        conn->fd = fd;
+        conn->deadlineUs = Metrics_nowInUs() + CONNECTION_TIMEOUT_US;
+        conn->requestLength = 0;
+        conn->responseLength = 0;
+        conn->responseSent = 0;
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = slot };
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+static void readRequest(connection_t *conn) {
+    while (true) {
+        size_t space = sizeof(conn->request) - 1 - conn->requestLength;
+        if (space == 0) {
+            closeConnection(conn); // Request too large for a scrape
+            return;
+        }
+        ssize_t received = recv(conn->fd, conn->request + conn->requestLength, space, 0);
+        if (received == 0) {
+            closeConnection(conn);
+            return;
+        }
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                closeConnection(conn);
+            }
+            return;
+        }
+        conn->requestLength += received;
+        conn->request[conn->requestLength] = '\0';
+
+        // The body of a GET is ignored, so the end of the headers is enough
+        if (strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n")) {
+            buildResponse(conn);
+            struct epoll_event event = { .events = EPOLLOUT, .data.u32 = conn - connections };
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+            writeResponse(conn);
+            return;
+        }
+    }
+}
+
+static void buildResponse(connection_t *conn) {
+    const char *status = "200 OK";
+    const char *contentType = "text/plain; version=0.0.4; charset=utf-8";
+    char *body = conn->response + HEADER_ROOM;
+    size_t bodyLength;
+
+    if (strncmp(conn->request, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+        contentType = "text/plain";
+        bodyLength = snprintf(body, RESPONSE_BUFFER_SIZE - HEADER_ROOM, "Only GET is supported.\n");
+    } else if (strncmp(conn->request + 4, "/metrics ", 9) != 0) {
+        status = "404 Not Found";
+        contentType = "text/plain";
+        bodyLength = snprintf(body, RESPONSE_BUFFER_SIZE - HEADER_ROOM, "Metrics are at /metrics.\n");
+    } else {
+        bodyLength = Metrics_formatPrometheus(body, RESPONSE_BUFFER_SIZE - HEADER_ROOM);
+    }
+
+    char header[HEADER_ROOM];
+    int headerLength = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        status, contentType, bodyLength);
+    assert(headerLength > 0 && headerLength < HEADER_ROOM);
+
+    // Slide the body back against the headers
+    memcpy(conn->response, header, headerLength);
+    memmove(conn->response + headerLength, body, bodyLength);
+    conn->responseLength = headerLength + bodyLength;
+    conn->responseSent = 0;
+}
+
+static void writeResponse(connection_t *conn) {
+    while (conn->responseSent < conn->responseLength) {
+        ssize_t sent = send(conn->fd, conn->response + conn->responseSent,
+            conn->responseLength - conn->responseSent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                closeConnection(conn);
+            }
+            return; // Wait for EPOLLOUT
+        }
+        conn->responseSent += sent;
+    }
+    closeConnection(conn);
+}
+
+static void closeConnection(connection_t *conn) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+static void closeIdleConnections(void) {
+    int64_t now = Metrics_nowInUs();
+    for (int i = 0; i < METRICS_HTTP_MAX_CONNECTIONS; i++) {
+        if (connections[i].fd >= 0 && now > connections[i].deadlineUs) {
+            closeConnection(&connections[i]);
+        }
+    }
+}
@@ -0,0 +1,379 @@
+/* params.c
+ *
+ * This file implements the parameter store. Every value is kept in one 64-bit
+ * atomic (doubles by their bit pattern), so reads never lock; writers and the
+ * callback list share a mutex.
+ */
+
+#include "hal/params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_CALLBACKS 16
+#define MAX_LINE_LENGTH 256
+
+typedef struct {
+    const char *name;
+    Params_type_t type;
+    double min;
+    double max;
+    double defaultValue;
+    bool startupOnly;       // Only read once at startup; a change needs a restart
+    const char *help;
+} paramInfo_t;
+
+typedef struct {
+    enum Params_id id;
+    Params_callback_t callback;
+} listener_t;
+
+// `lower` must stay below `upper` (or equal to it unless isStrict)
+typedef struct {
+    enum Params_id lower;
+    enum Params_id upper;
+    bool isStrict;
+} constraint_t;
+
+static const paramInfo_t paramInfo[PARAMS_COUNT] = {
+    [PARAMS_UDP_PORT] = { "udp_port", PARAMS_TYPE_INT, 1024, 65535, 12345, true, "UDP command port" },
+    // At 850 us even a read that takes no time fits one second (plus a period) in MAX_HISTORY_SIZE
+    [PARAMS_SAMPLE_PERIOD_US] = { "sample_period_us", PARAMS_TYPE_INT, 850, 100000, 1000, false, "sleep between light samples" },
+    [PARAMS_DIP_THRESHOLD_V] = { "dip_threshold_v", PARAMS_TYPE_DOUBLE, 0.01, 3.3, 0.1, false, "drop below the average that counts as a dip" },
+    [PARAMS_DIP_HYSTERESIS_V] = { "dip_hysteresis_v", PARAMS_TYPE_DOUBLE, 0.0, 1.0, 0.03, false, "rise above the dip threshold needed before the next dip" },
+    [PARAMS_SMOOTHING_FACTOR] = { "smoothing_factor", PARAMS_TYPE_DOUBLE, 0.0001, 1.0, 0.001, false, "weight of a new sample in the moving average" },
+    [PARAMS_PWM_MIN_HZ] = { "pwm_min_hz", PARAMS_TYPE_INT, 0, 1000, 0, false, "lowest LED flash frequency" },
+    [PARAMS_PWM_MAX_HZ] = { "pwm_max_hz", PARAMS_TYPE_INT, 0, 1000, 500, false, "highest LED flash frequency" },
+    [PARAMS_PWM_RAMP_MS] = { "pwm_ramp_ms", PARAMS_TYPE_INT, 0, 5000, 0, false, "glide to each new LED frequency over this time (0 to jump)" },
+    [PARAMS_ENCODER_ACCELERATION] = { "encoder_acceleration", PARAMS_TYPE_BOOL, 0, 1, 1, false, "count up to 8 steps per detent when the knob spins fast" },
+    [PARAMS_LCD_REFRESH_MS] = { "lcd_refresh_ms", PARAMS_TYPE_INT, 100, 10000, 1000, false, "LCD refresh period" },
+    [PARAMS_PRINT_STATISTICS] = { "print_statistics", PARAMS_TYPE_BOOL, 0, 1, 1, false, "print statistics to the console every second" },
+    [PARAMS_ADC_SIMULATED] = { "adc_simulated", PARAMS_TYPE_BOOL, 0, 1, 0, true, "run without the board: read the built-in TLA2024 simulator, no encoder or LCD" },
+    [PARAMS_PWM_SIMULATED] = { "pwm_simulated", PARAMS_TYPE_BOOL, 0, 1, 0, true, "drive simulated PWM channels instead of /dev/hat/pwm" },
+    [PARAMS_SIM_OFFSET_V] = { "sim_offset_v", PARAMS_TYPE_DOUBLE, 0.0, 3.3, 1.5, false, "simulated input: DC level" },
+    [PARAMS_SIM_SINE_V] = { "sim_sine_v", PARAMS_TYPE_DOUBLE, 0.0, 3.3, 0.2, false, "simulated input: sine amplitude" },
+    [PARAMS_SIM_SINE_HZ] = { "sim_sine_hz", PARAMS_TYPE_DOUBLE, 0.01, 1000.0, 1.0, false, "simulated input: sine frequency" },
+    [PARAMS_SIM_SQUARE_V] = { "sim_square_v", PARAMS_TYPE_DOUBLE, 0.0, 3.3, 0.1, false, "simulated input: square wave amplitude at the LED flash frequency" },
+    [PARAMS_SIM_NOISE_V] = { "sim_noise_v", PARAMS_TYPE_DOUBLE, 0.0, 1.0, 0.005, false, "simulated input: peak uniform noise" },
+    [PARAMS_SIM_DIPS_PER_S] = { "sim_dips_per_s", PARAMS_TYPE_DOUBLE, 0.0, 100.0, 2.0, false, "simulated input: dips per second" },
+    [PARAMS_SIM_DIP_V] = { "sim_dip_v", PARAMS_TYPE_DOUBLE, 0.0, 3.3, 0.5, false, "simulated input: depth of each 5 ms dip" },
+    [PARAMS_SIM_BUS_KHZ] = { "sim_bus_khz", PARAMS_TYPE_INT, 0, 3400, 400, false, "simulated I2C clock that paces transfers (0 for none)" },
+};
+
+static const constraint_t constraints[] = {
+    { PARAMS_PWM_MIN_HZ, PARAMS_PWM_MAX_HZ, false },
+    { PARAMS_DIP_HYSTERESIS_V, PARAMS_DIP_THRESHOLD_V, true },
+};
+
+#define NUM_CONSTRAINTS (sizeof(constraints) / sizeof(constraints[0]))
+
+static atomic_llong values[PARAMS_COUNT];
+static listener_t listeners[MAX_CALLBACKS];
+static int numListeners = 0;
+static bool isInitialized = false;
+static pthread_mutex_t paramsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function Prototypes
+static long long encodeDouble(double value);
+static double decodeDouble(long long bits);
+static bool parseValue(const paramInfo_t *info, const char *text, long long *encoded);
+static double toDouble(enum Params_id id, long long encoded);
+static bool isConsistent(enum Params_id id, long long encoded);
+static bool setValue(enum Params_id id, const char *text, bool isChecked);
+static void resetConflicts(const char *path);
+static void loadConfigFile(const char *path);
+static char* trim(char *text);
+
+
+static long long encodeDouble(double value) {
+    long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double decodeDouble(long long bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static double toDouble(enum Params_id id, long long encoded) {
+    return (paramInfo[id].type == PARAMS_TYPE_DOUBLE) ? decodeDouble(encoded) : (double)encoded;
+}
+
+// Whether `encoded` for `id` keeps every constraint with the current values.
+// Must be called with paramsMutex held.
+static bool isConsistent(enum Params_id id, long long encoded) {
+    for (size_t i = 0; i < NUM_CONSTRAINTS; i++) {
+        const constraint_t *constraint = &constraints[i];
+        if (constraint->lower != id && constraint->upper != id) {
+            continue;
+        }
+        double lower = toDouble(constraint->lower,
+            (constraint->lower == id) ? encoded : atomic_load(&values[constraint->lower]));
+        double upper = toDouble(constraint->upper,
+            (constraint->upper == id) ? encoded : atomic_load(&values[constraint->upper]));
+        if (constraint->isStrict ? !(lower < upper) : !(lower <= upper)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Params_init(const char *configPath) {
+    assert(!isInitialized);
+    for (int i = 0; i < PARAMS_COUNT; i++) {
+        const paramInfo_t *info = &paramInfo[i];
+        long long value = (info->type == PARAMS_TYPE_DOUBLE)
+            ? encodeDouble(info->defaultValue)
+            : (long long)info->defaultValue;
+        atomic_store(&values[i], value);
+    }
+    numListeners = 0;
+    isInitialized = true;
+
+    if (configPath) {
+        loadConfigFile(configPath);
+    }
+}
+
+void Params_cleanup(void) {
+    assert(isInitialized);
+    isInitialized = false;
+}
+
+int Params_getInt(enum Params_id id) {
+    assert(id < PARAMS_COUNT && paramInfo[id].type == PARAMS_TYPE_INT);
+    return (int)atomic_load_explicit(&values[id], memory_order_relaxed);
+}
+
+double Params_getDouble(enum Params_id id) {
+    assert(id < PARAMS_COUNT && paramInfo[id].type == PARAMS_TYPE_DOUBLE);
+    return decodeDouble(atomic_load_explicit(&values[id], memory_order_relaxed));
+}
+
+bool Params_getBool(enum Params_id id) {
+    assert(id < PARAMS_COUNT && paramInfo[id].type == PARAMS_TYPE_BOOL);
+    return atomic_load_explicit(&values[id], memory_order_relaxed) != 0;
+}
+
+int Params_find(const char *name) {
+    for (int i = 0; i < PARAMS_COUNT; i++) {
+        if (strcmp(paramInfo[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* Params_getName(enum Params_id id) {
+    assert(id < PARAMS_COUNT);
+    return paramInfo[id].name;
+}
+
+static bool parseValue(const paramInfo_t *info, const char *text, long long *encoded) {
+    char *end;
+    if (info->type == PARAMS_TYPE_BOOL) {
+        if (strcmp(text, "1") == 0 || strcasecmp(text, "true") == 0 || strcasecmp(text, "on") == 0) {
+            *encoded = 1;
+            return true;
+        }
+        if (strcmp(text, "0") == 0 || strcasecmp(text, "false") == 0 || strcasecmp(text, "off") == 0) {
+            *encoded = 0;
+            return true;
+        }
+        return false;
+    }
+    if (info->type == PARAMS_TYPE_INT) {
+        long long value = strtoll(text, &end, 10);
+        if (end == text || *end != '\0' || value < info->min || value > info->max) {
+            return false;
+        }
+        *encoded = value;
+        return true;
+    }
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value >= info->min && value <= info->max)) {
+        return false;
+    }
+    *encoded = encodeDouble(value);
+    return true;
+}
+
+bool Params_isStartupOnly(enum Params_id id) {
+    assert(id < PARAMS_COUNT);
+    return paramInfo[id].startupOnly;
+}
+
+bool Params_setFromString(enum Params_id id, const char *value) {
+    assert(isInitialized);
+    assert(id < PARAMS_COUNT);
+    if (paramInfo[id].startupOnly) {
+        return false; // The running program would not use the new value
+    }
+    return setValue(id, value, true);
+}
+
+// The config file is loaded without the constraints, so their order in the
+// file does not matter; resetConflicts() checks them once it is read
+static bool setValue(enum Params_id id, const char *text, bool isChecked) {
+    long long encoded;
+    if (!parseValue(&paramInfo[id], text, &encoded)) {
+        return false;
+    }
+
+    // Callbacks run outside the lock so they may read (or set) parameters
+    Params_callback_t callbacks[MAX_CALLBACKS];
+    int numCallbacks = 0;
+    pthread_mutex_lock(&paramsMutex);
+    if (isChecked && !isConsistent(id, encoded)) {
+        pthread_mutex_unlock(&paramsMutex);
+        return false;
+    }
+    atomic_store(&values[id], encoded);
+    for (int i = 0; i < numListeners; i++) {
+        if (listeners[i].id == id) {
+            callbacks[numCallbacks++] = listeners[i].callback;
+        }
+    }
+    pthread_mutex_unlock(&paramsMutex);
+
+    for (int i = 0; i < numCallbacks; i++) {
+        callbacks[i](id);
+    }
+    return true;
+}
+
+void Params_format(enum Params_id id, char *buffer, size_t size) {
+    assert(id < PARAMS_COUNT);
+    const paramInfo_t *info = &paramInfo[id];
+    switch (info->type) {
+    case PARAMS_TYPE_INT:
+        snprintf(buffer, size, "%s = %d", info->name, Params_getInt(id));
+        break;
+    case PARAMS_TYPE_DOUBLE:
+        snprintf(buffer, size, "%s = %g", info->name, Params_getDouble(id));
+        break;
+    case PARAMS_TYPE_BOOL:
+        snprintf(buffer, size, "%s = %s", info->name, Params_getBool(id) ? "true" : "false");
+        break;
+    }
+}
+
+void Params_describe(enum Params_id id, char *buffer, size_t size) {
+    assert(id < PARAMS_COUNT);
+    const paramInfo_t *info = &paramInfo[id];
+    const char *suffix = info->startupOnly ? ", config file only" : "";
+    char relation[MAX_LINE_LENGTH] = "";
+    for (size_t i = 0; i < NUM_CONSTRAINTS; i++) {
+        const constraint_t *constraint = &constraints[i];
+        if (constraint->lower == id) {
+            snprintf(relation, sizeof(relation), " %s %s", constraint->isStrict ? "below" : "at most",
+                paramInfo[constraint->upper].name);
+        } else if (constraint->upper == id) {
+            snprintf(relation, sizeof(relation), " %s %s", constraint->isStrict ? "above" : "at least",
+                paramInfo[constraint->lower].name);
+        }
+    }
+    switch (info->type) {
+    case PARAMS_TYPE_INT:
+        snprintf(buffer, size, "int %d..%d%s, %s%s", (int)info->min, (int)info->max, relation, info->help, suffix);
+        break;
+    case PARAMS_TYPE_DOUBLE:
+        snprintf(buffer, size, "double %g..%g%s, %s%s", info->min, info->max, relation, info->help, suffix);
+        break;
+    case PARAMS_TYPE_BOOL:
+        snprintf(buffer, size, "bool, %s%s", info->help, suffix);
+        break;
+    }
+}
+
+void Params_onChange(enum Params_id id, Params_callback_t callback) {
+    assert(isInitialized);
+    pthread_mutex_lock(&paramsMutex);
+    assert(numListeners < MAX_CALLBACKS);
+    listeners[numListeners].id = id;
+    listeners[numListeners].callback = callback;
+    numListeners++;
+    pthread_mutex_unlock(&paramsMutex);
+}
+
+static char* trim(char *text) {
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return text;
+}
+
+// Bad lines are reported and skipped, so a typo never stops the program
+static void loadConfigFile(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return; // No config file: keep the defaults
+    }
+
+    char line[MAX_LINE_LENGTH];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        line[strcspn(line, "#")] = '\0';
+        char *text = trim(line);
+        if (*text == '\0') {
+            continue;
+        }
+
+        char *equals = strchr(text, '=');
+        if (!equals) {
+            fprintf(stderr, "%s:%d: expected `name = value`\n", path, lineNumber);
+            continue;
+        }
+        *equals = '\0';
+        char *name = trim(text);
+        char *value = trim(equals + 1);
+
+        int id = Params_find(name);
+        if (id < 0) {
+            fprintf(stderr, "%s:%d: unknown parameter `%s`\n", path, lineNumber, name);
+        } else if (!setValue(id, value, false)) {
+            char description[MAX_LINE_LENGTH];
+            Params_describe(id, description, sizeof(description));
+            fprintf(stderr, "%s:%d: invalid value `%s` for %s (%s)\n", path, lineNumber, value, name, description);
+        }
+    }
+    fclose(file);
+    resetConflicts(path);
+}
+
+// A pair that breaks its constraint goes back to the defaults
+static void resetConflicts(const char *path) {
+    for (size_t i = 0; i < NUM_CONSTRAINTS; i++) {
+        const constraint_t *constraint = &constraints[i];
+        pthread_mutex_lock(&paramsMutex);
+        bool isValid = isConsistent(constraint->lower, atomic_load(&values[constraint->lower]));
+        if (!isValid) {
+            enum Params_id ids[] = { constraint->lower, constraint->upper };
+            for (int j = 0; j < 2; j++) {
+                const paramInfo_t *info = &paramInfo[ids[j]];
+                atomic_store(&values[ids[j]], (info->type == PARAMS_TYPE_DOUBLE)
+                    ? encodeDouble(info->defaultValue)
+                    : (long long)info->defaultValue);
+            }
+        }
+        pthread_mutex_unlock(&paramsMutex);
+        if (!isValid) {
+            fprintf(stderr, "%s: %s must be %s %s; using the defaults for both\n", path,
+                paramInfo[constraint->lower].name, constraint->isStrict ? "below" : "at most",
+                paramInfo[constraint->upper].name);
+        }
+    }
+}
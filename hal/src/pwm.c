@@ -0,0 +1,206 @@
+/* pwm.c
+ *
+ * This file implements the sysfs PWM channel driver. Values are formatted
+ * with a small integer formatter into a stack buffer (no stdio), and sysfs
+ * takes each value as one write at offset 0. Simulated channels skip the
+ * writes and only update the cache.
+ */
+
+#include "hal/pwm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MAX_PATH_LENGTH 128
+#define INTEGER_BUFFER_SIZE 24
+
+// Function Prototypes
+static int openFile(const char *directory, const char *name);
+static long long readValue(int fd);
+static int readPolarity(int fd);
+static int writeText(const Pwm_channel_t *channel, int fd, const char *text, size_t length);
+static int writeValue(const Pwm_channel_t *channel, int fd, long long value);
+static size_t formatInteger(char *buffer, long long value);
+static int setPeriodNs(Pwm_channel_t *channel, long long periodNs);
+static int setDutyCycleNs(Pwm_channel_t *channel, long long dutyCycleNs);
+
+
+static int openFile(const char *directory, const char *name) {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s%s", directory, name);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        int error = errno;
+        fprintf(stderr, "PWM: unable to open %s: %s\n", path, strerror(error));
+        return -error;
+    }
+    return fd;
+}
+
+int Pwm_open(Pwm_channel_t *channel, const char *directory) {
+    channel->isSimulated = false;
+    channel->polarityFd = -1;
+    channel->periodFd = openFile(directory, "period");
+    channel->dutyCycleFd = openFile(directory, "duty_cycle");
+    channel->enableFd = openFile(directory, "enable");
+    int error = (channel->periodFd < 0) ? channel->periodFd
+        : (channel->dutyCycleFd < 0) ? channel->dutyCycleFd
+        : (channel->enableFd < 0) ? channel->enableFd
+        : 0;
+    if (error < 0) {
+        Pwm_close(channel);
+        return error;
+    }
+
+    // Start from what the hardware has, so the first update is ordered correctly
+    channel->periodNs = readValue(channel->periodFd);
+    channel->dutyCycleNs = readValue(channel->dutyCycleFd);
+    channel->enabled = (int)readValue(channel->enableFd);
+
+    // Polarity is optional; not every PWM driver can invert its output
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%spolarity", directory);
+    channel->polarityFd = open(path, O_RDWR | O_CLOEXEC);
+    channel->inverted = (channel->polarityFd < 0) ? 0 : readPolarity(channel->polarityFd);
+    return 0;
+}
+
+void Pwm_openSimulated(Pwm_channel_t *channel) {
+    *channel = (Pwm_channel_t) {
+        .isSimulated = true,
+        .periodFd = -1,
+        .dutyCycleFd = -1,
+        .enableFd = -1,
+        .polarityFd = -1,
+        .periodNs = PWM_UNKNOWN,
+        .dutyCycleNs = PWM_UNKNOWN,
+        .enabled = 0,
+        .inverted = 0,
+    };
+}
+
+void Pwm_close(Pwm_channel_t *channel) {
+    int *fds[] = { &channel->periodFd, &channel->dutyCycleFd, &channel->enableFd, &channel->polarityFd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+        }
+        *fds[i] = -1;
+    }
+}
+
+static long long readValue(int fd) {
+    char buffer[INTEGER_BUFFER_SIZE];
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return PWM_UNKNOWN;
+    }
+    buffer[length] = '\0';
+    char *end;
+    long long value = strtoll(buffer, &end, 10);
+    return (end == buffer) ? PWM_UNKNOWN : value;
+}
+
+static int readPolarity(int fd) {
+    char buffer[16];
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return PWM_UNKNOWN;
+    }
+    buffer[length] = '\0';
+    return strncmp(buffer, "inversed", 8) == 0;
+}
+
+// Digits of a non-negative value, no terminator; returns the length
+static size_t formatInteger(char *buffer, long long value) {
+    char digits[INTEGER_BUFFER_SIZE];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = 0; i < count; i++) {
+        buffer[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+static int writeText(const Pwm_channel_t *channel, int fd, const char *text, size_t length) {
+    if (channel->isSimulated) {
+        return 0;
+    }
+    if (pwrite(fd, text, length, 0) != (ssize_t)length) {
+        return errno ? -errno : -EIO;
+    }
+    return 0;
+}
+
+static int writeValue(const Pwm_channel_t *channel, int fd, long long value) {
+    char buffer[INTEGER_BUFFER_SIZE];
+    size_t length = formatInteger(buffer, value);
+    return writeText(channel, fd, buffer, length);
+}
+
+static int setPeriodNs(Pwm_channel_t *channel, long long periodNs) {
+    if (channel->periodNs == periodNs) {
+        return 0;
+    }
+    int result = writeValue(channel, channel->periodFd, periodNs);
+    channel->periodNs = (result == 0) ? periodNs : PWM_UNKNOWN;
+    return result;
+}
+
+static int setDutyCycleNs(Pwm_channel_t *channel, long long dutyCycleNs) {
+    if (channel->dutyCycleNs == dutyCycleNs) {
+        return 0;
+    }
+    int result = writeValue(channel, channel->dutyCycleFd, dutyCycleNs);
+    channel->dutyCycleNs = (result == 0) ? dutyCycleNs : PWM_UNKNOWN;
+    return result;
+}
+
+int Pwm_setPeriod(Pwm_channel_t *channel, long long periodNs, long long dutyCycleNs) {
+    if (periodNs <= 0 || dutyCycleNs < 0 || dutyCycleNs > periodNs) {
+        return -EINVAL;
+    }
+
+    int result;
+    if (channel->periodNs == PWM_UNKNOWN || channel->dutyCycleNs == PWM_UNKNOWN) {
+        // Unknown state: a zero duty cycle is valid with any period
+        result = setDutyCycleNs(channel, 0);
+        if (result == 0) result = setPeriodNs(channel, periodNs);
+        if (result == 0) result = setDutyCycleNs(channel, dutyCycleNs);
+    } else if (periodNs >= channel->periodNs) {
+        result = setPeriodNs(channel, periodNs);
+        if (result == 0) result = setDutyCycleNs(channel, dutyCycleNs);
+    } else {
+        result = setDutyCycleNs(channel, dutyCycleNs);
+        if (result == 0) result = setPeriodNs(channel, periodNs);
+    }
+    return result;
+}
+
+int Pwm_setEnabled(Pwm_channel_t *channel, bool enabled) {
+    if (channel->enabled == enabled) {
+        return 0;
+    }
+    int result = writeValue(channel, channel->enableFd, enabled ? 1 : 0);
+    channel->enabled = (result == 0) ? enabled : PWM_UNKNOWN;
+    return result;
+}
+
+int Pwm_setInverted(Pwm_channel_t *channel, bool inverted) {
+    if (channel->inverted == inverted) {
+        return 0;
+    }
+    if (channel->polarityFd < 0 && !channel->isSimulated) {
+        return -ENOTSUP;
+    }
+    const char *text = inverted ? "inversed" : "normal";
+    int result = writeText(channel, channel->polarityFd, text, strlen(text));
+    channel->inverted = (result == 0) ? inverted : PWM_UNKNOWN;
+    return result;
+}
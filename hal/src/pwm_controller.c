@@ -0,0 +1,240 @@
+/* pwm_controller.c
+ *
+ * This file implements the PWM controller. Each channel has a mutex that
+ * serialises PwmController_update() on it; the effective frequency is also
+ * kept in an atomic so the sampling path can read it without locking.
+ */
+
+#include "hal/pwm_controller.h"
+#include "hal/pwm.h"
+#include "hal/pwm_sweep.h"
+#include "hal/params.h"
+#include "hal/udp_commands.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define NANOSECONDS_IN_1SECOND 1000000000LL
+#define CHANNEL_LINE_SIZE 96
+
+typedef struct {
+    const char *name;
+    const char *directory;        // sysfs directory, ending in '/'
+} channelInfo_t;
+
+typedef struct {
+    Pwm_channel_t pwm;
+    PwmController_settings_t settings;
+    atomic_int frequencyHz;       // Effective: 0 while off
+    pthread_mutex_t mutex;
+} channel_t;
+
+static const channelInfo_t channelInfo[PWM_CONTROLLER_COUNT] = {
+    [PWM_CONTROLLER_LED] = { "led", "/dev/hat/pwm/GPIO12/" },
+};
+
+static channel_t channels[PWM_CONTROLLER_COUNT];
+static bool isInitialized = false;
+
+// Function Prototypes
+static void openChannel(channel_t *channel, const channelInfo_t *info, bool isSimulated);
+static size_t formatChannel(char *buffer, size_t size, enum PwmController_channel id);
+static void onPwm(UdpCommands_context_t *ctx);
+
+static const UdpCommands_command_t controllerCommands[] = {
+    { "pwm", "[channel:word] [hz:int] [duty:num] [polarity:normal|inversed] [state:on|off]",
+        "list the PWM channels, or set one (duty in %; omitted settings are kept).", onPwm },
+};
+
+
+void PwmController_init(void) {
+    assert(!isInitialized);
+    bool isSimulated = Params_getBool(PARAMS_PWM_SIMULATED);
+    for (int i = 0; i < PWM_CONTROLLER_COUNT; i++) {
+        openChannel(&channels[i], &channelInfo[i], isSimulated);
+    }
+    isInitialized = true;
+    UdpCommands_registerAll(controllerCommands, sizeof(controllerCommands) / sizeof(controllerCommands[0]));
+}
+
+void PwmController_cleanup(void) {
+    assert(isInitialized);
+    isInitialized = false;
+    for (int i = 0; i < PWM_CONTROLLER_COUNT; i++) {
+        Pwm_close(&channels[i].pwm); // Outputs keep running as they are
+        pthread_mutex_destroy(&channels[i].mutex);
+    }
+}
+
+// A channel that cannot be opened falls back to a simulated one, so the rest
+// of the application keeps working without it
+static void openChannel(channel_t *channel, const channelInfo_t *info, bool isSimulated) {
+    pthread_mutex_init(&channel->mutex, NULL);
+    if (isSimulated || Pwm_open(&channel->pwm, info->directory) < 0) {
+        if (!isSimulated) {
+            fprintf(stderr, "PWM: channel %s is simulated\n", info->name);
+        }
+        Pwm_openSimulated(&channel->pwm);
+    }
+
+    // Start from what the hardware is doing
+    const Pwm_channel_t *pwm = &channel->pwm;
+    bool hasPeriod = pwm->periodNs > 0;
+    channel->settings = (PwmController_settings_t) {
+        .frequencyHz = hasPeriod ? (int)llround((double)NANOSECONDS_IN_1SECOND / pwm->periodNs) : 0,
+        .dutyCycle = (hasPeriod && pwm->dutyCycleNs >= 0) ? (double)pwm->dutyCycleNs / pwm->periodNs : 0.5,
+        .isInverted = pwm->inverted == 1,
+        .isEnabled = pwm->enabled == 1,
+    };
+    bool isOn = channel->settings.isEnabled && channel->settings.frequencyHz > 0;
+    atomic_store_explicit(&channel->frequencyHz, isOn ? channel->settings.frequencyHz : 0, memory_order_relaxed);
+}
+
+int PwmController_find(const char *name) {
+    for (int i = 0; i < PWM_CONTROLLER_COUNT; i++) {
+        if (strcmp(channelInfo[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* PwmController_getName(enum PwmController_channel channel) {
+    assert(channel >= 0 && channel < PWM_CONTROLLER_COUNT);
+    return channelInfo[channel].name;
+}
+
+int PwmController_update(enum PwmController_channel id, unsigned int fields, const PwmController_settings_t *changes) {
+    assert(isInitialized);
+    assert(id >= 0 && id < PWM_CONTROLLER_COUNT);
+    channel_t *channel = &channels[id];
+    pthread_mutex_lock(&channel->mutex);
+
+    // Merge into the cached settings under the lock, so concurrent updates of
+    // other fields are never overwritten with stale values
+    PwmController_settings_t settings = channel->settings;
+    if (fields & PWM_CONTROLLER_FREQUENCY) settings.frequencyHz = changes->frequencyHz;
+    if (fields & PWM_CONTROLLER_DUTY_CYCLE) settings.dutyCycle = changes->dutyCycle;
+    if (fields & PWM_CONTROLLER_POLARITY) settings.isInverted = changes->isInverted;
+    if (fields & PWM_CONTROLLER_ENABLE) settings.isEnabled = changes->isEnabled;
+    if (settings.frequencyHz < 0 || !(settings.dutyCycle >= 0.0 && settings.dutyCycle <= 1.0)) {
+        pthread_mutex_unlock(&channel->mutex);
+        return -EINVAL;
+    }
+
+    bool isOn = settings.isEnabled && settings.frequencyHz > 0;
+    Pwm_channel_t *pwm = &channel->pwm;
+
+    // Turning off goes first so the output never runs with the new timing,
+    // and the polarity can only change while the output is disabled
+    int result = 0;
+    if (!isOn || pwm->inverted != settings.isInverted) {
+        result = Pwm_setEnabled(pwm, false);
+    }
+    if (result == 0) {
+        result = Pwm_setInverted(pwm, settings.isInverted);
+    }
+    if (result == 0 && settings.frequencyHz > 0) {
+        long long periodNs = NANOSECONDS_IN_1SECOND / settings.frequencyHz;
+        result = Pwm_setPeriod(pwm, periodNs, llround(periodNs * settings.dutyCycle));
+    }
+    if (result == 0) {
+        result = Pwm_setEnabled(pwm, isOn);
+    }
+    if (result == 0) {
+        channel->settings = settings;
+        atomic_store_explicit(&channel->frequencyHz, isOn ? settings.frequencyHz : 0, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&channel->mutex);
+    return result;
+}
+
+void PwmController_get(enum PwmController_channel id, PwmController_settings_t *settings) {
+    assert(isInitialized);
+    assert(id >= 0 && id < PWM_CONTROLLER_COUNT);
+    pthread_mutex_lock(&channels[id].mutex);
+    *settings = channels[id].settings;
+    pthread_mutex_unlock(&channels[id].mutex);
+}
+
+bool PwmController_isFrequencyAllowed(int hz) {
+    return hz >= Params_getInt(PARAMS_PWM_MIN_HZ) && hz <= Params_getInt(PARAMS_PWM_MAX_HZ);
+}
+
+int PwmController_getFrequency(enum PwmController_channel id) {
+    assert(id >= 0 && id < PWM_CONTROLLER_COUNT);
+    return atomic_load_explicit(&channels[id].frequencyHz, memory_order_relaxed);
+}
+
+static size_t formatChannel(char *buffer, size_t size, enum PwmController_channel id) {
+    PwmController_settings_t settings;
+    PwmController_get(id, &settings);
+    int length = snprintf(buffer, size, "%s: %d Hz, duty %.1f%%, %s, %s%s\n",
+        channelInfo[id].name, settings.frequencyHz, settings.dutyCycle * 100.0,
+        settings.isInverted ? "inversed" : "normal", settings.isEnabled ? "on" : "off",
+        channels[id].pwm.isSimulated ? " (simulated)" : "");
+    return (length < 0) ? 0 : (size_t)length;
+}
+
+static void onPwm(UdpCommands_context_t *ctx) {
+    char response[PWM_CONTROLLER_COUNT * CHANNEL_LINE_SIZE];
+    if (ctx->argc == 1) {
+        size_t length = 0;
+        for (int i = 0; i < PWM_CONTROLLER_COUNT && length < sizeof(response); i++) {
+            length += formatChannel(response + length, sizeof(response) - length, i);
+        }
+        UdpCommands_reply(ctx, response);
+        return;
+    }
+
+    int id = PwmController_find(ctx->argv[1]);
+    if (id < 0) {
+        UdpCommands_reply(ctx, "Unknown PWM channel. Type 'pwm' for a list of channels.\n");
+        return;
+    }
+    if (ctx->argc > 2) {
+        PwmController_settings_t settings = { 0 };
+        unsigned int fields = PWM_CONTROLLER_FREQUENCY;
+        if (!UdpCommands_parseInt(ctx->argv[2], &settings.frequencyHz)
+            || !PwmController_isFrequencyAllowed(settings.frequencyHz)) {
+            UdpCommands_replyf(ctx, "Invalid frequency. Expected %d..%d Hz (pwm_min_hz..pwm_max_hz).\n",
+                Params_getInt(PARAMS_PWM_MIN_HZ), Params_getInt(PARAMS_PWM_MAX_HZ));
+            return;
+        }
+        if (ctx->argc > 3) {
+            char *end;
+            settings.dutyCycle = strtod(ctx->argv[3], &end) / 100.0;
+            if (end == ctx->argv[3] || *end != '\0') {
+                UdpCommands_reply(ctx, "Invalid duty cycle. Expected 0..100.\n");
+                return;
+            }
+            fields |= PWM_CONTROLLER_DUTY_CYCLE;
+        }
+        if (ctx->argc > 4) {
+            settings.isInverted = strcmp(ctx->argv[4], "inversed") == 0;
+            fields |= PWM_CONTROLLER_POLARITY;
+        }
+        if (ctx->argc > 5) {
+            settings.isEnabled = strcmp(ctx->argv[5], "on") == 0;
+            fields |= PWM_CONTROLLER_ENABLE;
+        }
+
+        PwmSweep_stop(id); // Otherwise its next tick overwrites the new frequency
+        int result = PwmController_update(id, fields, &settings);
+        if (result == -EINVAL) {
+            UdpCommands_reply(ctx, "Invalid duty cycle. Expected 0..100.\n");
+            return;
+        }
+        if (result < 0) {
+            UdpCommands_replyf(ctx, "Unable to update %s: %s\n", channelInfo[id].name, strerror(-result));
+            return;
+        }
+    }
+    formatChannel(response, sizeof(response), id);
+    UdpCommands_reply(ctx, response);
+}
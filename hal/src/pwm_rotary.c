@@ -6,6 +6,7 @@
     */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdatomic.h>
@@ -13,83 +14,124 @@
 #include <fcntl.h>
 #include <assert.h>
 #include "hal/rotary_encoder_statemachine.h"
-#include "hal/udp_listener.h"
+#include "hal/params.h"
+#include "hal/pwm_controller.h"
+#include "hal/pwm_sweep.h"
 
-#define PWM_PATH "/dev/hat/pwm/GPIO12/"
-#define NANOSECONDS_IN_1SECOND 1000000000
-#define MIN_FREQUENCY 0
-#define MAX_FREQUENCY 500
 #define BASE_FREQUENCY 10
 
-atomic_int frequency = 0;
 static bool isInitialized = false;
+static bool hasEncoder = false;    // Not with adc_simulated, which runs without the board
 static pthread_mutex_t pwm_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t pwmThread;
 // static volatile bool running = true;
 
 
+static int clamp_frequency(int hz) {
+    int minFrequency = Params_getInt(PARAMS_PWM_MIN_HZ); //0 to 500 Hz by default
+    int maxFrequency = Params_getInt(PARAMS_PWM_MAX_HZ);
+    if (hz < minFrequency) hz = minFrequency;
+    if (hz > maxFrequency) hz = maxFrequency;
+    return hz;
+}
+
+// Must be called with pwm_mutex held.
 static void set_pwm_frequency(int hz) {
-    if (hz < MIN_FREQUENCY) hz = MIN_FREQUENCY; //Supporting only from 0 to 500 Hz
-    if (hz > MAX_FREQUENCY) hz = MAX_FREQUENCY;
-    
-    if (hz == frequency) return; // Avoid unnecessary updates
-    frequency = hz;
-    
-    int period_ns = hz == 0 ? 0 : NANOSECONDS_IN_1SECOND / hz;
-    int duty_cycle_ns = period_ns / 2; //Split the period in half, first hald on and second half off.
-    
-    FILE *fp;
-    fp = fopen(PWM_PATH "duty_cycle", "w");
-    fprintf(fp, "0"); fclose(fp);
-    
-    fp = fopen(PWM_PATH "period", "w");
-    fprintf(fp, "%d", period_ns); fclose(fp);
-    
-    fp = fopen(PWM_PATH "duty_cycle", "w");
-    fprintf(fp, "%d", duty_cycle_ns); fclose(fp);
-    
-    fp = fopen(PWM_PATH "enable", "w");
-    fprintf(fp, "1"); fclose(fp); //turn on emitter
+    hz = clamp_frequency(hz);
+    PwmController_settings_t settings;
+    PwmController_get(PWM_CONTROLLER_LED, &settings);
+    int targetHz = PwmSweep_getTargetHz(PWM_CONTROLLER_LED);
+    if (hz == targetHz) return; // Already gliding there
+    if (targetHz < 0 && hz == settings.frequencyHz && settings.isEnabled) return; // Avoid unnecessary updates
+
+    int rampMs = Params_getInt(PARAMS_PWM_RAMP_MS);
+    if (rampMs > 0) {
+        // Glide from inside the bounds: they may just have been narrowed past the current frequency
+        PwmSweep_start(PWM_CONTROLLER_LED, clamp_frequency(settings.frequencyHz), hz, rampMs, PWM_SWEEP_LINEAR, 0);
+        return;
+    }
+    PwmSweep_stop(PWM_CONTROLLER_LED); // The knob takes over from a running sweep
+    settings.frequencyHz = hz;
+    settings.isEnabled = true; //turn on emitter (0 Hz keeps it off)
     
+    int result = PwmController_update(PWM_CONTROLLER_LED, PWM_CONTROLLER_FREQUENCY | PWM_CONTROLLER_ENABLE, &settings);
+    if (result < 0) {
+        fprintf(stderr, "PWM: unable to set %d Hz: %s\n", hz, strerror(-result));
+    }
     // printf("Set frequency to %d Hz\n", hz);
 }
 
+// Frequency the encoder turns from: where a running sweep or glide ends, else
+// the current one, whether or not the LED is on
+static int get_pwm_frequency(void) {
+    int targetHz = PwmSweep_getTargetHz(PWM_CONTROLLER_LED);
+    if (targetHz >= 0) {
+        return targetHz;
+    }
+    PwmController_settings_t settings;
+    PwmController_get(PWM_CONTROLLER_LED, &settings);
+    return settings.frequencyHz;
+}
+
 static void *encoder_thread(void *arg) {
     (void)arg; // Suppress unused parameter warning
-    while (UdpListener_isRunning()) {
-        int counter_value = RotaryEncoderStateMachine_getValue();
-        if (counter_value != 0) {
-            int new_frequency = frequency + counter_value;
-            printf("add counter: %d\n", counter_value);
-            pthread_mutex_lock(&pwm_mutex);
-            set_pwm_frequency(new_frequency);
-            
-            // Reset the counter to avoid accumulation
-            RotaryEncoderStateMachine_setValue(0);
-            pthread_mutex_unlock(&pwm_mutex);
-
+    while (true) {
+        // Sleeps until the encoder turns; detents that arrive meanwhile are coalesced
+        int counter_value = RotaryEncoderStateMachine_waitForChange();
+        if (counter_value == 0) {
+            break; // The encoder thread has stopped
         }
+        printf("add counter: %d\n", counter_value);
+        pthread_mutex_lock(&pwm_mutex);
+        set_pwm_frequency(get_pwm_frequency() + counter_value);
+        pthread_mutex_unlock(&pwm_mutex);
     }
     return NULL;
 }
 
+// Pull the current frequency back inside new bounds
+static void onFrequencyBoundsChanged(enum Params_id id) {
+    (void)id;
+    pthread_mutex_lock(&pwm_mutex);
+    set_pwm_frequency(get_pwm_frequency());
+    pthread_mutex_unlock(&pwm_mutex);
+}
+
 void PwmRotary_init(void){
     assert(!isInitialized);
-    RotaryEncoderStateMachine_init();
-    set_pwm_frequency(BASE_FREQUENCY);
-    pthread_create(&pwmThread, NULL, &encoder_thread, NULL);
+    hasEncoder = !Params_getBool(PARAMS_ADC_SIMULATED);
+    if (hasEncoder) {
+        RotaryEncoderStateMachine_init();
+    }
+    PwmController_settings_t settings = {
+        .frequencyHz = clamp_frequency(BASE_FREQUENCY),
+        .dutyCycle = 0.5, //Split the period in half, first half on and second half off.
+        .isEnabled = true,
+    };
+    unsigned int fields = PWM_CONTROLLER_FREQUENCY | PWM_CONTROLLER_DUTY_CYCLE | PWM_CONTROLLER_ENABLE; // Keeps the polarity
+    if (PwmController_update(PWM_CONTROLLER_LED, fields, &settings) < 0) {
+        fprintf(stderr, "PWM: unable to start the LED\n");
+    }
+    Params_onChange(PARAMS_PWM_MIN_HZ, onFrequencyBoundsChanged);
+    Params_onChange(PARAMS_PWM_MAX_HZ, onFrequencyBoundsChanged);
+    if (hasEncoder) {
+        pthread_create(&pwmThread, NULL, &encoder_thread, NULL);
+    }
     isInitialized = true;
 }
 
 void PwmRotary_cleanup(void){
     assert(isInitialized);
     // running = false;
-    pthread_join(pwmThread, NULL);
-    RotaryEncoderStateMachine_cleanup();
+    if (hasEncoder) {
+        RotaryEncoderStateMachine_stop(); // Wakes the thread blocked waiting for a turn
+        pthread_join(pwmThread, NULL);
+        RotaryEncoderStateMachine_cleanup();
+    }
     isInitialized = false;
 }
 
 int PwmRotary_getFrequency(void){
     assert(isInitialized);
-    return frequency;
+    return PwmController_getFrequency(PWM_CONTROLLER_LED);
 }
\ No newline at end of file
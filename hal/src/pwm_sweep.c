@@ -0,0 +1,316 @@
+/* pwm_sweep.c
+ *
+ * This file implements the PWM sweep engine. One thread serves every channel:
+ * it applies whichever sweeps are due, then sleeps on a condition variable
+ * (on CLOCK_MONOTONIC) until the earliest next update, so starting or
+ * stopping a sweep wakes it at once and an idle engine never wakes at all.
+ */
+
+#include "hal/pwm_sweep.h"
+#include "hal/metrics.h"
+#include "hal/udp_commands.h"
+#include "hal/params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define US_PER_MS 1000LL
+#define US_PER_SECOND 1000000LL
+#define MAX_DURATION_MS (24 * 3600 * 1000)
+#define STATUS_LINE_SIZE 128
+#define SWEEP_USAGE "Usage: sweep <from> <to> <duration> [linear|log|steps] [steps]\n"
+
+typedef struct {
+    bool isActive;
+    PwmSweep_shape_t shape;
+    int fromHz;
+    int toHz;
+    int steps;
+    int currentHz;                // Last frequency applied
+    int64_t startUs;
+    int64_t durationUs;
+    int64_t nextUs;               // When the next update is due
+} sweep_t;
+
+static const char *shapeNames[] = {
+    [PWM_SWEEP_LINEAR] = "linear",
+    [PWM_SWEEP_LOG] = "log",
+    [PWM_SWEEP_STEPS] = "steps",
+};
+
+static sweep_t sweeps[PWM_CONTROLLER_COUNT];
+static bool isInitialized = false;
+static bool isStopping = false;
+static pthread_t sweepThread;
+static pthread_mutex_t sweepMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweepChanged;
+
+// Function Prototypes
+static void* sweepThreadFunc(void *arg);
+static void updateSweep(enum PwmController_channel channel, sweep_t *sweep, int64_t nowUs);
+static int frequencyAt(const sweep_t *sweep, int64_t elapsedUs);
+static int64_t nextUpdateUs(const sweep_t *sweep, int64_t elapsedUs);
+static void applyFrequency(enum PwmController_channel channel, sweep_t *sweep, int hz);
+static int parseDuration(const char *text);
+static bool parseShape(const char *text, PwmSweep_shape_t *shape);
+static void onSweep(UdpCommands_context_t *ctx);
+
+static const UdpCommands_command_t sweepCommands[] = {
+    { "sweep", "[from:int|stop] [to:int] [duration:word] [shape:linear|log|steps] [steps:int]",
+        "sweep the LED from one frequency to another, e.g. 'sweep 10 500 30s log' (duration in ms, s or m).", onSweep },
+};
+
+
+void PwmSweep_init(void) {
+    assert(!isInitialized);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Same clock as Metrics_nowInUs()
+    pthread_cond_init(&sweepChanged, &attr);
+    pthread_condattr_destroy(&attr);
+
+    memset(sweeps, 0, sizeof(sweeps));
+    isStopping = false;
+    isInitialized = true;
+    pthread_create(&sweepThread, NULL, &sweepThreadFunc, NULL);
+    UdpCommands_registerAll(sweepCommands, sizeof(sweepCommands) / sizeof(sweepCommands[0]));
+}
+
+void PwmSweep_cleanup(void) {
+    assert(isInitialized);
+    pthread_mutex_lock(&sweepMutex);
+    isStopping = true;
+    pthread_cond_signal(&sweepChanged);
+    pthread_mutex_unlock(&sweepMutex);
+    pthread_join(sweepThread, NULL);
+    pthread_cond_destroy(&sweepChanged);
+    isInitialized = false;
+}
+
+int PwmSweep_start(enum PwmController_channel channel, int fromHz, int toHz, int durationMs,
+    PwmSweep_shape_t shape, int steps)
+{
+    assert(isInitialized);
+    assert(channel >= 0 && channel < PWM_CONTROLLER_COUNT);
+    if (fromHz < 0 || toHz < 0 || durationMs < 0 || durationMs > MAX_DURATION_MS
+        || (shape == PWM_SWEEP_LOG && (fromHz == 0 || toHz == 0))
+        || (shape == PWM_SWEEP_STEPS && steps < 2)) {
+        return -EINVAL;
+    }
+    if (!PwmController_isFrequencyAllowed(fromHz) || !PwmController_isFrequencyAllowed(toHz)) {
+        return -ERANGE;
+    }
+
+    pthread_mutex_lock(&sweepMutex);
+    int64_t nowUs = Metrics_nowInUs();
+    sweeps[channel] = (sweep_t) {
+        .isActive = true,
+        .shape = shape,
+        .fromHz = fromHz,
+        .toHz = toHz,
+        .steps = steps,
+        .currentHz = -1,
+        .startUs = nowUs,
+        .durationUs = durationMs * US_PER_MS,
+        .nextUs = nowUs, // Apply the start frequency right away
+    };
+    pthread_cond_signal(&sweepChanged);
+    pthread_mutex_unlock(&sweepMutex);
+    return 0;
+}
+
+void PwmSweep_stop(enum PwmController_channel channel) {
+    assert(isInitialized);
+    assert(channel >= 0 && channel < PWM_CONTROLLER_COUNT);
+    pthread_mutex_lock(&sweepMutex);
+    sweeps[channel].isActive = false;
+    pthread_mutex_unlock(&sweepMutex);
+}
+
+int PwmSweep_getTargetHz(enum PwmController_channel channel) {
+    assert(isInitialized);
+    assert(channel >= 0 && channel < PWM_CONTROLLER_COUNT);
+    pthread_mutex_lock(&sweepMutex);
+    int targetHz = sweeps[channel].isActive ? sweeps[channel].toHz : -1;
+    pthread_mutex_unlock(&sweepMutex);
+    return targetHz;
+}
+
+static void* sweepThreadFunc(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&sweepMutex);
+    while (!isStopping) {
+        int64_t nowUs = Metrics_nowInUs();
+        int64_t wakeUs = INT64_MAX;
+        for (int i = 0; i < PWM_CONTROLLER_COUNT; i++) {
+            sweep_t *sweep = &sweeps[i];
+            if (sweep->isActive && sweep->nextUs <= nowUs) {
+                updateSweep(i, sweep, nowUs);
+            }
+            if (sweep->isActive && sweep->nextUs < wakeUs) {
+                wakeUs = sweep->nextUs;
+            }
+        }
+
+        if (wakeUs == INT64_MAX) {
+            pthread_cond_wait(&sweepChanged, &sweepMutex);
+        } else {
+            struct timespec deadline = { wakeUs / US_PER_SECOND, (wakeUs % US_PER_SECOND) * 1000 };
+            pthread_cond_timedwait(&sweepChanged, &sweepMutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&sweepMutex);
+    return NULL;
+}
+
+// Must be called with sweepMutex held.
+static void updateSweep(enum PwmController_channel channel, sweep_t *sweep, int64_t nowUs) {
+    int64_t elapsedUs = nowUs - sweep->startUs;
+    if (elapsedUs >= sweep->durationUs) {
+        sweep->isActive = false;
+        applyFrequency(channel, sweep, sweep->toHz);
+        return;
+    }
+    sweep->nextUs = sweep->startUs + nextUpdateUs(sweep, elapsedUs);
+    applyFrequency(channel, sweep, frequencyAt(sweep, elapsedUs));
+}
+
+static int frequencyAt(const sweep_t *sweep, int64_t elapsedUs) {
+    double fraction = (double)elapsedUs / sweep->durationUs;
+    switch (sweep->shape) {
+    case PWM_SWEEP_LOG:
+        return (int)lround(sweep->fromHz * pow((double)sweep->toHz / sweep->fromHz, fraction));
+    case PWM_SWEEP_STEPS: {
+        int64_t step = elapsedUs * sweep->steps / sweep->durationUs;
+        return (int)lround(sweep->fromHz + (double)(sweep->toHz - sweep->fromHz) * step / (sweep->steps - 1));
+    }
+    case PWM_SWEEP_LINEAR:
+    default:
+        return (int)lround(sweep->fromHz + (sweep->toHz - sweep->fromHz) * fraction);
+    }
+}
+
+// Time since the start of the next update: the next tick or step boundary
+static int64_t nextUpdateUs(const sweep_t *sweep, int64_t elapsedUs) {
+    int64_t nextUs;
+    if (sweep->shape == PWM_SWEEP_STEPS) {
+        int64_t step = elapsedUs * sweep->steps / sweep->durationUs;
+        nextUs = ((step + 1) * sweep->durationUs + sweep->steps - 1) / sweep->steps; // Round up into the step
+    } else {
+        int64_t tickUs = PWM_SWEEP_TICK_MS * US_PER_MS;
+        nextUs = (elapsedUs / tickUs + 1) * tickUs;
+    }
+    return nextUs < sweep->durationUs ? nextUs : sweep->durationUs;
+}
+
+// Must be called with sweepMutex held.
+static void applyFrequency(enum PwmController_channel channel, sweep_t *sweep, int hz) {
+    if (hz == sweep->currentHz) {
+        return;
+    }
+    PwmController_settings_t settings = { .frequencyHz = hz, .isEnabled = true };
+    int result = PwmController_update(channel, PWM_CONTROLLER_FREQUENCY | PWM_CONTROLLER_ENABLE, &settings);
+    if (result < 0) {
+        fprintf(stderr, "PWM sweep: stopped on %s at %d Hz: %s\n",
+            PwmController_getName(channel), hz, strerror(-result));
+        sweep->isActive = false;
+        return;
+    }
+    sweep->currentHz = hz;
+}
+
+// "250ms", "30s", "2m" or a plain number of seconds; returns ms, or -1
+static int parseDuration(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0.0) {
+        return -1;
+    }
+    double scale = (strcmp(end, "ms") == 0) ? 1.0
+        : (strcmp(end, "s") == 0 || *end == '\0') ? 1000.0
+        : (strcmp(end, "m") == 0) ? 60000.0
+        : -1.0;
+    if (scale < 0.0 || value * scale > MAX_DURATION_MS) {
+        return -1;
+    }
+    return (int)lround(value * scale);
+}
+
+static bool parseShape(const char *text, PwmSweep_shape_t *shape) {
+    for (size_t i = 0; i < sizeof(shapeNames) / sizeof(shapeNames[0]); i++) {
+        if (strcmp(text, shapeNames[i]) == 0) {
+            *shape = (PwmSweep_shape_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void onSweep(UdpCommands_context_t *ctx) {
+    enum PwmController_channel channel = PWM_CONTROLLER_LED;
+    const char *name = PwmController_getName(channel);
+
+    if (ctx->argc == 1) {
+        char status[STATUS_LINE_SIZE];
+        pthread_mutex_lock(&sweepMutex);
+        sweep_t sweep = sweeps[channel];
+        pthread_mutex_unlock(&sweepMutex);
+        if (sweep.isActive) {
+            snprintf(status, sizeof(status), "%s: sweeping %d -> %d Hz (%s), %.1f of %.1f s, now %d Hz\n",
+                name, sweep.fromHz, sweep.toHz, shapeNames[sweep.shape],
+                (Metrics_nowInUs() - sweep.startUs) / (double)US_PER_SECOND,
+                sweep.durationUs / (double)US_PER_SECOND, PwmController_getFrequency(channel));
+        } else {
+            snprintf(status, sizeof(status), "%s: not sweeping, %d Hz\n", name, PwmController_getFrequency(channel));
+        }
+        UdpCommands_reply(ctx, status);
+        return;
+    }
+
+    if (strcmp(ctx->argv[1], "stop") == 0) {
+        PwmSweep_stop(channel);
+        UdpCommands_replyf(ctx, "Sweep stopped at %d Hz.\n", PwmController_getFrequency(channel));
+        return;
+    }
+    int fromHz, toHz;
+    if (ctx->argc < 4 || !UdpCommands_parseInt(ctx->argv[1], &fromHz) || !UdpCommands_parseInt(ctx->argv[2], &toHz)) {
+        UdpCommands_reply(ctx, SWEEP_USAGE);
+        return;
+    }
+
+    int durationMs = parseDuration(ctx->argv[3]);
+    if (durationMs < 0) {
+        UdpCommands_reply(ctx, "Invalid duration. Expected e.g. 500ms, 30s or 2m (at most 24 h).\n");
+        return;
+    }
+    PwmSweep_shape_t shape = PWM_SWEEP_LINEAR;
+    if (ctx->argc > 4 && !parseShape(ctx->argv[4], &shape)) {
+        UdpCommands_reply(ctx, SWEEP_USAGE);
+        return;
+    }
+    int steps = PWM_SWEEP_DEFAULT_STEPS;
+    if (ctx->argc > 5 && !UdpCommands_parseInt(ctx->argv[5], &steps)) {
+        UdpCommands_reply(ctx, SWEEP_USAGE);
+        return;
+    }
+
+    int result = PwmSweep_start(channel, fromHz, toHz, durationMs, shape, steps);
+    if (result == -ERANGE) {
+        UdpCommands_replyf(ctx, "Invalid sweep. Frequencies must be within %d..%d Hz (pwm_min_hz..pwm_max_hz).\n",
+            Params_getInt(PARAMS_PWM_MIN_HZ), Params_getInt(PARAMS_PWM_MAX_HZ));
+        return;
+    }
+    if (result < 0) {
+        UdpCommands_reply(ctx, (shape == PWM_SWEEP_LOG) ? "Invalid sweep. Log sweeps need both frequencies above 0.\n"
+            : "Invalid sweep. Steps must be at least 2.\n");
+        return;
+    }
+    UdpCommands_replyf(ctx, "Sweeping %s from %d to %d Hz over %.1f s (%s).\n",
+        name, fromHz, toHz, durationMs / 1000.0, shapeNames[shape]);
+}
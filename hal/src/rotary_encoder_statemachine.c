@@ -1,121 +1,184 @@
-/* rotary_encoder_statemachine.c 
+/* rotary_encoder_statemachine.c
 * Rotary encoder state machine implementation as discussed in class. Uses state machine to keep track of the rotary encoder value.
+* The state machine is a lookup table: the previous and current levels of
+* lines A and B form a 4-bit index whose entry is the quarter step taken
+* (+1 clockwise, -1 counterclockwise, 0 for bounces and impossible jumps).
+* Four quarter steps make one detent.
 */
 #include "hal/rotary_encoder_statemachine.h"
 #include "hal/gpio.h"
-#include "hal/udp_listener.h"
+#include "hal/params.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <stdatomic.h>
 #include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define GPIO_CHIP GPIO_CHIP_2
 #define GPIO_LINE_A 7
 #define GPIO_LINE_B 8
 
+#define LEVEL_A 0x2
+#define LEVEL_B 0x1
+#define LEVELS_AT_REST (LEVEL_A | LEVEL_B)   // Both lines idle high between detents
+#define QUARTER_STEPS_PER_DETENT 4
+#define MAX_EVENTS_PER_LINE 16              // Events read per line per system call (the kernel queues 16)
+#define MAX_PENDING_EVENTS (4 * MAX_EVENTS_PER_LINE)
+#define NS_PER_MS 1000000LL
+
 
 static bool isInitialized = false;
 struct GpioLine* s_lineA = NULL;
 struct GpioLine* s_lineB = NULL;
 static atomic_int counter = 0;
-static bool ccwFlag = false;
-static bool cwFlag = false;
 static pthread_t stateMachineThread;
+static int epollFd = -1;
+static int stopEventFd = -1;                 // Written by RotaryEncoderStateMachine_stop()
+static pthread_mutex_t changeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changeCondition = PTHREAD_COND_INITIALIZER;
+static bool isStopped = false;
 // static volatile bool stateMachineRunning = true;
 
+// Decoder state, only touched by the state machine thread
+static unsigned int levels = LEVELS_AT_REST;
+static int quarterSteps = 0;                 // Since the last detent
+static int64_t lastDetentNs = 0;
+static struct gpiod_line_event pendingA[MAX_PENDING_EVENTS]; // Read but not decoded yet
+static struct gpiod_line_event pendingB[MAX_PENDING_EVENTS];
+static int numPendingA = 0;
+static int numPendingB = 0;
+
 
-// Function Prototypes 
+// Function Prototypes
 void RotaryEncoderStateMachine_init();
 void RotaryEncoderStateMachine_cleanup();
+void RotaryEncoderStateMachine_stop();
 static void* RotaryEncoderStateMachine_doState(void* arg);
 int RotaryEncoderStateMachine_getValue();
-static void on_clockwise(void);
-static void on_counterclockwise(void);
+static void notify_change(void);
+static bool drain_line(struct GpioLine *line, struct gpiod_line_event *events, int *count);
+static int decode_events(int64_t untilNs);
+static int acceleration_for(int64_t intervalNs);
 
 
 /*
     Define the Statemachine Data Structures
 */
-struct stateEvent {
-    struct state* pNextState;
-    void (*action)();
+// Clockwise, A leads: 11 -> 01 -> 00 -> 10 -> 11 (levels are A << 1 | B)
+static const int8_t quarterStepTable[16] = {
+    //          to 00  01  10  11
+    /* 00 */        0, -1, +1,  0,
+    /* 01 */       +1,  0,  0, -1,
+    /* 10 */       -1,  0,  0, +1,
+    /* 11 */        0, +1, -1,  0,
 };
-struct state {
-    struct stateEvent aRise;
-    struct stateEvent aFall;
-    struct stateEvent bRise;
-    struct stateEvent bFall;
+
+// Spinning faster than a detent per `maxIntervalMs` moves `factor` steps per detent
+typedef struct {
+    int64_t maxIntervalMs;
+    int factor;
+} acceleration_t;
+
+static const acceleration_t accelerationSteps[] = {
+    { 80, 2 },
+    { 40, 4 },
+    { 20, 8 },
 };
 
 
 /*
     START STATEMACHINE
 */
-static void reset_flag(void) {
-    cwFlag = false;
-    ccwFlag = false;
-}
-
-static void on_clockwise(void) {
-    if(cwFlag) {
-        counter++;
-        reset_flag();
-    }
-}
-static void on_counterclockwise(void) {
-    if(ccwFlag) {
-        counter--;
-        reset_flag();
+static int acceleration_for(int64_t intervalNs) {
+    int factor = 1;
+    for (size_t i = 0; i < sizeof(accelerationSteps) / sizeof(accelerationSteps[0]); i++) {
+        factor = (intervalNs < accelerationSteps[i].maxIntervalMs * NS_PER_MS) ? accelerationSteps[i].factor : factor;
     }
+    return factor;
 }
 
-static void track_clockwise(void) {
-    if (cwFlag == false) {
-        cwFlag = true;
-        ccwFlag = false;
-    }
+static inline int64_t event_ns(const struct gpiod_line_event *event) {
+    return event->ts.tv_sec * 1000000000LL + event->ts.tv_nsec;
 }
 
-static void track_counterclockwise(void) {
-    if (ccwFlag == false) {
-        ccwFlag = true;
-        cwFlag = false;
-    }
+// Run one edge through the table; returns the (accelerated) detents it completes
+static inline int decode_edge(unsigned int lineMask, const struct gpiod_line_event *event, bool accelerate) {
+    unsigned int isRising = event->event_type == GPIOD_LINE_EVENT_RISING_EDGE;
+    unsigned int next = (levels & ~lineMask) | (lineMask & -isRising);
+    quarterSteps += quarterStepTable[(levels << 2) | next];
+    levels = next;
+
+    int detents = quarterSteps / QUARTER_STEPS_PER_DETENT;
+    quarterSteps -= detents * QUARTER_STEPS_PER_DETENT;
+    quarterSteps *= (levels != LEVELS_AT_REST); // Missed edges never carry past a detent
+
+    int64_t nowNs = event_ns(event);
+    int factor = accelerate ? acceleration_for(nowNs - lastDetentNs) : 1;
+    lastDetentNs = detents ? nowNs : lastDetentNs;
+    return detents * factor;
 }
 
-struct state states[] = {
-    { // State 0
-        .aRise = {&states[0], reset_flag},
-        .aFall = {&states[1], track_clockwise},
-        .bRise = {&states[0], reset_flag},
-        .bFall = {&states[3], track_counterclockwise},
-    },
-    { // State 1
-        .aRise = {&states[0], on_counterclockwise},
-        .aFall = {&states[1], NULL},
-        .bRise = {&states[1], NULL},
-        .bFall = {&states[2], NULL},
-    },
-    { // State 2
-        .aRise = {&states[3], NULL},
-        .aFall = {&states[2], NULL},
-        .bRise = {&states[1], NULL},
-        .bFall = {&states[2], NULL},
-    },
-    { // State 3
-        .aRise = {&states[3], NULL},
-        .aFall = {&states[2], NULL},
-        .bRise = {&states[0], on_clockwise},
-        .bFall = {&states[3], NULL},
+// Decode both lines' pending events in timestamp order, up to `untilNs`;
+// later ones stay pending. Returns the detents turned
+static int decode_events(int64_t untilNs)
+{
+    bool accelerate = Params_getBool(PARAMS_ENCODER_ACCELERATION);
+    int detents = 0;
+    int a = 0;
+    int b = 0;
+    while (true) {
+        bool hasA = a < numPendingA && event_ns(&pendingA[a]) <= untilNs;
+        bool hasB = b < numPendingB && event_ns(&pendingB[b]) <= untilNs;
+        if (!hasA && !hasB) {
+            break;
+        }
+        bool takeA = !hasB || (hasA && event_ns(&pendingA[a]) <= event_ns(&pendingB[b]));
+        detents += takeA
+            ? decode_edge(LEVEL_A, &pendingA[a++], accelerate)
+            : decode_edge(LEVEL_B, &pendingB[b++], accelerate);
     }
-};
+    numPendingA -= a;
+    numPendingB -= b;
+    memmove(pendingA, &pendingA[a], numPendingA * sizeof(pendingA[0]));
+    memmove(pendingB, &pendingB[b], numPendingB * sizeof(pendingB[0]));
+    return detents;
+}
 /*
     END STATEMACHINE
 */
 
-struct state* pCurrentState = &states[0];
+// Read `line`'s queued events into `events` until the queue is empty (true) or
+// `events` holds MAX_PENDING_EVENTS (false); the line's fd is non-blocking
+static bool drain_line(struct GpioLine *line, struct gpiod_line_event *events, int *count) {
+    while (*count < MAX_PENDING_EVENTS) {
+        int space = MAX_PENDING_EVENTS - *count;
+        int numRead = Gpio_readEvents(line, &events[*count], space < MAX_EVENTS_PER_LINE ? space : MAX_EVENTS_PER_LINE);
+        if (numRead == -1) {
+            if (errno == EAGAIN) {
+                return true;
+            }
+            perror("Line Event");
+            exit(EXIT_FAILURE);
+        }
+        *count += numRead;
+    }
+    return false;
+}
+
+// Wake the consumer blocked in RotaryEncoderStateMachine_waitForChange()
+static void notify_change(void) {
+    pthread_mutex_lock(&changeMutex);
+    pthread_cond_broadcast(&changeCondition);
+    pthread_mutex_unlock(&changeMutex);
+}
 
 
 
@@ -125,20 +188,66 @@ void RotaryEncoderStateMachine_init()
     Gpio_initialize();
     s_lineA = Gpio_openForEvents(GPIO_CHIP, GPIO_LINE_A);
     s_lineB = Gpio_openForEvents(GPIO_CHIP, GPIO_LINE_B);
+
+    // Subscribe once and wait on both lines' event fds and the stop eventfd
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    stopEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || stopEventFd < 0) {
+        perror("Unable to create encoder epoll");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event stopEvent = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, stopEventFd, &stopEvent) < 0) {
+        perror("Unable to watch encoder stop event");
+        exit(EXIT_FAILURE);
+    }
+    struct GpioLine* lines[] = { s_lineA, s_lineB };
+    for (int i = 0; i < 2; i++) {
+        Gpio_requestEvents(lines[i]);
+        int fd = Gpio_getEventFd(lines[i]);
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) { // Lets drain_line() stop at an empty queue
+            perror("Unable to make encoder line non-blocking");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = lines[i] };
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("Unable to watch encoder line");
+            exit(EXIT_FAILURE);
+        }
+    }
+    levels = LEVELS_AT_REST;
+    quarterSteps = 0;
+    lastDetentNs = 0;
+    numPendingA = 0;
+    numPendingB = 0;
+    isStopped = false;
     pthread_create(&stateMachineThread, NULL, &RotaryEncoderStateMachine_doState, NULL);
     isInitialized = true;
 }
 void RotaryEncoderStateMachine_cleanup()
 {
     assert(isInitialized);
-    // stateMachineRunning = false;
+    RotaryEncoderStateMachine_stop(); // In case the caller has not
     pthread_join(stateMachineThread, NULL);
+    close(epollFd);
+    epollFd = -1;
+    close(stopEventFd);
+    stopEventFd = -1;
     Gpio_close(s_lineA);
     Gpio_close(s_lineB);
     Gpio_cleanup();
     isInitialized = false;
 }
 
+void RotaryEncoderStateMachine_stop()
+{
+    assert(isInitialized);
+    uint64_t one = 1;
+    if (write(stopEventFd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Unable to stop the encoder thread");
+    }
+}
+
 int RotaryEncoderStateMachine_getValue()
 {
     assert(isInitialized);
@@ -148,6 +257,19 @@ int RotaryEncoderStateMachine_getValue()
 void RotaryEncoderStateMachine_setValue(int value)
 {
     counter = value;
+    notify_change();
+}
+
+int RotaryEncoderStateMachine_waitForChange(void)
+{
+    assert(isInitialized);
+    pthread_mutex_lock(&changeMutex);
+    while (counter == 0 && !isStopped) {
+        pthread_cond_wait(&changeCondition, &changeMutex);
+    }
+    int change = atomic_exchange(&counter, 0); // Every detent since the last call
+    pthread_mutex_unlock(&changeMutex);
+    return change;
 }
 
 static void* RotaryEncoderStateMachine_doState(void* arg)
@@ -155,68 +277,56 @@ static void* RotaryEncoderStateMachine_doState(void* arg)
     (void)arg; // Suppress unused parameter warning
 
     // printf("\n\nWaiting for an event...\n");
-    while (UdpListener_isRunning()) {
-        struct gpiod_line_bulk bulkEvents;
-        int numEvents = Gpio_waitForLineChange(s_lineA, s_lineB, &bulkEvents);
-        if (numEvents == -1) {
+    bool isStopping = false;
+    while (!isStopping) {
+        struct epoll_event ready[3];
+        int numReady = epoll_wait(epollFd, ready, 3, -1);
+        if (numReady == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting on encoder lines");
             break;  // Exit the loop on failure
         }
 
-        // Iterate over the event
-        for (int i = 0; i < numEvents; i++)
+        for (int i = 0; i < numReady; i++)
         {
-            // Get the line handle for this event
-            struct gpiod_line *line_handle = gpiod_line_bulk_get_line(&bulkEvents, i);
-
-            // Get the number of this line
-            unsigned int this_line_number = gpiod_line_offset(line_handle);
-
-            // Get the line event
-            struct gpiod_line_event event;
-            if (gpiod_line_event_read(line_handle,&event) == -1) {
-                perror("Line Event");
-                exit(EXIT_FAILURE);
-            }
-
-
-            // Run the state machine
-            bool isRising = event.event_type == GPIOD_LINE_EVENT_RISING_EDGE;
-
-            // Can check with line it is, if you have more than one...
-            bool isA = this_line_number == GPIO_LINE_A;
-            bool isB = this_line_number == GPIO_LINE_B;
-
-            struct stateEvent* pStateEvent = NULL;
-            if (isA && isRising) {
-                pStateEvent = &pCurrentState->aRise;
-            } else if (isA && !isRising) {
-                pStateEvent = &pCurrentState->aFall;
-            } else if (isB && isRising) {
-                pStateEvent = &pCurrentState->bRise;
-            } else if (isB && !isRising) {
-                pStateEvent = &pCurrentState->bFall;
+            if (ready[i].data.ptr == NULL) {
+                isStopping = true; // Decode what was read first
             }
+        }
 
+        // Drain both lines, not just the ready ones: an edge on the other line
+        // may have landed since. A line that filled its buffer can still have
+        // older edges queued than the other line's newest, so only decode up to
+        // its last one and keep the rest for the next round.
+        bool isDrainedA = drain_line(s_lineA, pendingA, &numPendingA);
+        bool isDrainedB = drain_line(s_lineB, pendingB, &numPendingB);
+        int64_t untilNs = INT64_MAX;
+        if (!isDrainedA) {
+            untilNs = event_ns(&pendingA[numPendingA - 1]);
+        }
+        if (!isDrainedB && event_ns(&pendingB[numPendingB - 1]) < untilNs) {
+            untilNs = event_ns(&pendingB[numPendingB - 1]);
+        }
 
-            // Do the action
-            if (pStateEvent && pStateEvent->action) {
-                pStateEvent->action();
-            }
-            pCurrentState = pStateEvent ? pStateEvent->pNextState : pCurrentState;
-
-            // DEBUG INFO ABOUT STATEMACHINE
-            #if 0
-            int newState = (pCurrentState - &states[0]);
-            double time = event.ts.tv_sec + event.ts.tv_nsec / 1000000000.0;
-            printf("State machine Debug: i=%d/%d  line num/dir = %d %8s -> new state %d     [%f]\n", 
-                i, 
-                numEvents,
-                this_line_number, 
-                isRising ? "RISING": "falling", 
-                newState,
-                time);
-            #endif
+        int detents = decode_events(untilNs);
+        if (detents != 0) {
+            counter += detents;
+            notify_change(); // Once per burst
         }
+
+        // DEBUG INFO ABOUT STATEMACHINE
+        #if 0
+        printf("State machine Debug: A %d B %d pending -> levels %u, quarter steps %d, detents %d\n",
+            numPendingA, numPendingB, levels, quarterSteps, detents);
+        #endif
     }
+
+    // Let the consumer return from RotaryEncoderStateMachine_waitForChange()
+    pthread_mutex_lock(&changeMutex);
+    isStopped = true;
+    pthread_cond_broadcast(&changeCondition);
+    pthread_mutex_unlock(&changeMutex);
     return NULL;
 }
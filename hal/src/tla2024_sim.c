@@ -0,0 +1,194 @@
+/* tla2024_sim.c
+ *
+ * This file implements the simulated TLA2024. Conversions are computed lazily:
+ * each transaction first brings the conversion register up to date with the
+ * conversions that would have finished by now, sampling the waveform at the
+ * moment each one completed.
+ */
+
+#include "hal/tla2024_sim.h"
+#include "hal/i2c.h"
+#include "hal/params.h"
+#include "hal/pwm_rotary.h"
+#include "hal/metrics.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define REG_CONVERSION 0x00
+#define REG_CONFIG 0x01
+#define CONFIG_DEFAULT 0x8583      // Power-up value: single-shot, AIN0-AIN1, +-2.048 V, 1600 SPS
+#define CONFIG_OS 0x8000
+#define CONFIG_MODE_SINGLE 0x0100
+#define CONFIG_PGA(config) (((config) >> 9) & 0x7)
+#define CONFIG_DR(config) (((config) >> 5) & 0x7)
+#define CODE_MAX 2047
+#define CODE_MIN -2048
+#define BITS_PER_BYTE_ON_BUS 9     // Eight data bits and the ACK
+#define START_STOP_BITS 2
+#define PI 3.14159265358979323846
+
+typedef struct {
+    uint8_t pointer;
+    uint16_t config;
+    int16_t code;                  // Last completed conversion
+    bool isConverting;
+    int64_t conversionStartUs;
+} device_t;
+
+static const int dataRates[8] = { 128, 250, 490, 920, 1600, 2400, 3300, 3300 };
+static const double fullScaleVolts[8] = { 6.144, 4.096, 2.048, 1.024, 0.512, 0.256, 0.256, 0.256 };
+
+static device_t adc = { .config = CONFIG_DEFAULT };
+static int64_t attachedUs = 0;
+static uint32_t noiseState = 0x2545F491;
+static pthread_mutex_t adcMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function Prototypes
+static int simulateTransfer(void *context, struct i2c_msg *messages, int numMessages);
+static void paceTransfer(const struct i2c_msg *messages, int numMessages);
+static void updateConversions(int64_t nowUs);
+static int16_t convert(int64_t atUs);
+static double inputVolts(int64_t atUs);
+static double nextNoise(void);
+static void writeRegister(uint8_t reg, uint16_t value, int64_t nowUs);
+static uint16_t readRegister(uint8_t reg);
+
+
+void Tla2024Sim_attach(const char *bus, int address) {
+    pthread_mutex_lock(&adcMutex);
+    adc = (device_t) { .config = CONFIG_DEFAULT };
+    attachedUs = Metrics_nowInUs();
+    pthread_mutex_unlock(&adcMutex);
+    I2c_attachSimulator(bus, address, simulateTransfer, &adc);
+}
+
+static int simulateTransfer(void *context, struct i2c_msg *messages, int numMessages) {
+    (void)context;
+    paceTransfer(messages, numMessages);
+
+    pthread_mutex_lock(&adcMutex);
+    int64_t nowUs = Metrics_nowInUs();
+    updateConversions(nowUs);
+    for (int i = 0; i < numMessages; i++) {
+        struct i2c_msg *message = &messages[i];
+        if (message->flags & I2C_M_RD) {
+            // Registers are sent MSB first; reading on just repeats the register
+            uint16_t value = readRegister(adc.pointer);
+            for (int j = 0; j < message->len; j++) {
+                message->buf[j] = (j % 2 == 0) ? value >> 8 : value & 0xFF;
+            }
+            continue;
+        }
+        if (message->len == 0) {
+            continue;
+        }
+        if (message->buf[0] > REG_CONFIG) {
+            pthread_mutex_unlock(&adcMutex);
+            errno = EREMOTEIO; // The chip NACKs pointers to registers it does not have
+            return -1;
+        }
+        adc.pointer = message->buf[0];
+        if (message->len >= 3) {
+            writeRegister(adc.pointer, (message->buf[1] << 8) | message->buf[2], nowUs);
+        }
+    }
+    pthread_mutex_unlock(&adcMutex);
+    return numMessages;
+}
+
+// Take as long as the messages would on a real bus at sim_bus_khz
+static void paceTransfer(const struct i2c_msg *messages, int numMessages) {
+    int khz = Params_getInt(PARAMS_SIM_BUS_KHZ);
+    if (khz == 0) {
+        return;
+    }
+    long bits = START_STOP_BITS;
+    for (int i = 0; i < numMessages; i++) {
+        bits += (1 + messages[i].len) * BITS_PER_BYTE_ON_BUS; // Address byte, then data
+    }
+    long ns = bits * 1000000L / khz;
+    struct timespec reqDelay = {ns / 1000000000L, ns % 1000000000L};
+    nanosleep(&reqDelay, (struct timespec *) NULL);
+}
+
+// Must be called with adcMutex held.
+static void updateConversions(int64_t nowUs) {
+    if (!adc.isConverting) {
+        return;
+    }
+    int64_t periodUs = 1000000 / dataRates[CONFIG_DR(adc.config)];
+    int64_t elapsedUs = nowUs - adc.conversionStartUs;
+    if (elapsedUs < periodUs) {
+        return;
+    }
+    if (adc.config & CONFIG_MODE_SINGLE) {
+        adc.code = convert(adc.conversionStartUs + periodUs);
+        adc.isConverting = false;
+    } else {
+        adc.code = convert(adc.conversionStartUs + (elapsedUs / periodUs) * periodUs);
+    }
+}
+
+static int16_t convert(int64_t atUs) {
+    double volts = inputVolts(atUs); // Whatever the MUX pair, only its positive input is driven
+    double lsbVolts = fullScaleVolts[CONFIG_PGA(adc.config)] / (CODE_MAX + 1);
+    long code = lround(volts / lsbVolts);
+    if (code > CODE_MAX) code = CODE_MAX;
+    if (code < CODE_MIN) code = CODE_MIN;
+    return (int16_t)code;
+}
+
+static double inputVolts(int64_t atUs) {
+    double t = (atUs - attachedUs) / 1000000.0;
+    double volts = Params_getDouble(PARAMS_SIM_OFFSET_V);
+    volts += Params_getDouble(PARAMS_SIM_SINE_V) * sin(2.0 * PI * Params_getDouble(PARAMS_SIM_SINE_HZ) * t);
+
+    // The LED adds light during the first half of each PWM period
+    int flashHz = PwmRotary_getFrequency();
+    if (flashHz > 0 && fmod(t * flashHz, 1.0) < 0.5) {
+        volts += Params_getDouble(PARAMS_SIM_SQUARE_V);
+    }
+
+    double dipsPerSecond = Params_getDouble(PARAMS_SIM_DIPS_PER_S);
+    if (dipsPerSecond > 0.0 && fmod(t, 1.0 / dipsPerSecond) < TLA2024_SIM_DIP_MS / 1000.0) {
+        volts -= Params_getDouble(PARAMS_SIM_DIP_V);
+    }
+
+    volts += Params_getDouble(PARAMS_SIM_NOISE_V) * nextNoise();
+    return volts < 0.0 ? 0.0 : volts; // Inputs cannot go below ground
+}
+
+// Uniform in [-1, 1] (xorshift32); must be called with adcMutex held.
+static double nextNoise(void) {
+    noiseState ^= noiseState << 13;
+    noiseState ^= noiseState >> 17;
+    noiseState ^= noiseState << 5;
+    return noiseState / (double)UINT32_MAX * 2.0 - 1.0;
+}
+
+// Must be called with adcMutex held.
+static void writeRegister(uint8_t reg, uint16_t value, int64_t nowUs) {
+    if (reg != REG_CONFIG) {
+        return; // The conversion register is read only
+    }
+    adc.config = value & ~CONFIG_OS;
+    if (!(value & CONFIG_MODE_SINGLE) || (value & CONFIG_OS)) {
+        // Continuous mode restarts on every write; single-shot starts on OS = 1
+        adc.isConverting = true;
+        adc.conversionStartUs = nowUs;
+    }
+}
+
+// Must be called with adcMutex held.
+static uint16_t readRegister(uint8_t reg) {
+    if (reg == REG_CONVERSION) {
+        return (uint16_t)adc.code << 4;
+    }
+    // OS reads 1 only while a single-shot device is idle
+    bool isIdle = (adc.config & CONFIG_MODE_SINGLE) && !adc.isConverting;
+    return adc.config | (isIdle ? CONFIG_OS : 0);
+}
@@ -0,0 +1,106 @@
+/* udp_batch.c
+ *
+ * This file implements batched UDP sends using sendmmsg(), so a reply made of
+ * many datagrams costs one system call (or a few, if the kernel sends only
+ * part of the batch) instead of one per datagram.
+ */
+
+#define _GNU_SOURCE // sendmmsg()
+#include "hal/udp_batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+struct UdpBatch {
+    int count;
+    struct mmsghdr messages[UDP_BATCH_MAX_DATAGRAMS];
+    struct iovec iovecs[UDP_BATCH_MAX_DATAGRAMS];
+    size_t copiedBytes;                    // In use in `copies`
+    char copies[UDP_BATCH_COPY_SIZE];
+};
+
+struct UdpBatch* UdpBatch_create(void) {
+    struct UdpBatch *batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        perror("Unable to allocate UDP batch");
+        exit(EXIT_FAILURE);
+    }
+    return batch;
+}
+
+void UdpBatch_destroy(struct UdpBatch *batch) {
+    free(batch);
+}
+
+bool UdpBatch_add(
+    struct UdpBatch *batch,
+    const void *data,
+    size_t length,
+    const struct sockaddr *addr,
+    socklen_t addrLen
+) {
+    assert(batch);
+    if (batch->count == UDP_BATCH_MAX_DATAGRAMS) {
+        return false;
+    }
+
+    int i = batch->count++;
+    batch->iovecs[i].iov_base = (void*)data;
+    batch->iovecs[i].iov_len = length;
+
+    struct msghdr *hdr = &batch->messages[i].msg_hdr;
+    hdr->msg_name = (void*)addr;
+    hdr->msg_namelen = addrLen;
+    hdr->msg_iov = &batch->iovecs[i];
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = NULL;
+    hdr->msg_controllen = 0;
+    hdr->msg_flags = 0;
+    return true;
+}
+
+bool UdpBatch_addCopy(
+    struct UdpBatch *batch,
+    const void *data,
+    size_t length,
+    const struct sockaddr *addr,
+    socklen_t addrLen
+) {
+    assert(batch);
+    if (length > UDP_BATCH_COPY_SIZE - batch->copiedBytes) {
+        return false;
+    }
+    char *copy = batch->copies + batch->copiedBytes;
+    if (!UdpBatch_add(batch, copy, length, addr, addrLen)) {
+        return false;
+    }
+    memcpy(copy, data, length);
+    batch->copiedBytes += length;
+    return true;
+}
+
+int UdpBatch_size(const struct UdpBatch *batch) {
+    assert(batch);
+    return batch->count;
+}
+
+int UdpBatch_send(struct UdpBatch *batch, int sockfd) {
+    assert(batch);
+    int sent = 0;
+    while (sent < batch->count) {
+        int result = sendmmsg(sockfd, &batch->messages[sent], batch->count - sent, 0);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            perror("Batched send failed");
+            batch->count = 0;
+            batch->copiedBytes = 0;
+            return -1;
+        }
+        sent += result;
+    }
+    batch->count = 0;
+    batch->copiedBytes = 0;
+    return sent;
+}
@@ -0,0 +1,296 @@
+/* udp_commands.c
+ *
+ * This file implements the UDP command table. Commands are kept in
+ * registration order (which is also the order of the help text) and indexed by
+ * an open addressing hash table of command names, so a lookup costs one hash
+ * and usually one string compare. Argument schemas are parsed once, at
+ * registration.
+ */
+
+#include "hal/udp_commands.h"
+#include "hal/udp_batch.h"
+#include "hal/udp_format.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define HASH_TABLE_SIZE 128 // Power of two, well above UDP_COMMANDS_MAX_COMMANDS
+#define MAX_SPEC_LENGTH 48
+#define REPLY_BUFFER_SIZE 256
+
+static const UdpFormat_template_t unknownCommandReply =
+    UDP_FORMAT_TEMPLATE("Unknown command. Type 'help' for a list of commands.\n");
+
+typedef struct {
+    bool optional;
+    char spec[MAX_SPEC_LENGTH]; // `|` separated types or literals
+} argSpec_t;
+
+typedef struct {
+    UdpCommands_command_t command;
+    int numArgs;
+    int numRequired;
+    argSpec_t args[UDP_COMMANDS_MAX_ARGS];
+} entry_t;
+
+static entry_t entries[UDP_COMMANDS_MAX_COMMANDS];
+static int numEntries = 0;
+static int hashTable[HASH_TABLE_SIZE]; // Index into entries, -1 when empty
+static bool isInitialized = false;
+static pthread_rwlock_t tableLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Function Prototypes
+static uint32_t hashName(const char *name);
+static const entry_t* findEntry(const char *name);
+static void parseSchema(entry_t *entry);
+static bool matchesSpec(const char *value, const char *spec);
+static bool matchesAlternative(const char *value, const char *alternative, size_t length);
+
+
+void UdpCommands_init(void) {
+    assert(!isInitialized);
+    numEntries = 0;
+    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
+        hashTable[i] = -1;
+    }
+    isInitialized = true;
+}
+
+void UdpCommands_cleanup(void) {
+    assert(isInitialized);
+    isInitialized = false;
+}
+
+static uint32_t hashName(const char *name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *p = name; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    return hash;
+}
+
+// Must be called with tableLock held.
+static const entry_t* findEntry(const char *name) {
+    uint32_t slot = hashName(name) & (HASH_TABLE_SIZE - 1);
+    while (hashTable[slot] != -1) {
+        const entry_t *entry = &entries[hashTable[slot]];
+        if (strcmp(entry->command.name, name) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (HASH_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+static void parseSchema(entry_t *entry) {
+    entry->numArgs = 0;
+    entry->numRequired = 0;
+
+    const char *p = entry->command.args;
+    while (p && *p) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        assert(entry->numArgs < UDP_COMMANDS_MAX_ARGS);
+        argSpec_t *arg = &entry->args[entry->numArgs++];
+
+        char close = (*p == '[') ? ']' : '>';
+        arg->optional = (*p == '[');
+        assert(*p == '[' || *p == '<');
+        const char *end = strchr(p, close);
+        assert(end);
+
+        // Skip the argument name, if any
+        const char *spec = p + 1;
+        const char *colon = memchr(spec, ':', end - spec);
+        if (colon) {
+            spec = colon + 1;
+        }
+        size_t length = end - spec;
+        assert(length < MAX_SPEC_LENGTH);
+        memcpy(arg->spec, spec, length);
+        arg->spec[length] = '\0';
+
+        if (!arg->optional) {
+            assert(entry->numRequired == entry->numArgs - 1); // Required args come first
+            entry->numRequired++;
+        }
+        p = end + 1;
+    }
+}
+
+void UdpCommands_register(const UdpCommands_command_t *command) {
+    assert(isInitialized);
+    assert(command->name && command->handler);
+
+    pthread_rwlock_wrlock(&tableLock);
+    assert(numEntries < UDP_COMMANDS_MAX_COMMANDS);
+    assert(!findEntry(command->name));
+
+    entry_t *entry = &entries[numEntries];
+    entry->command = *command;
+    if (!entry->command.args) {
+        entry->command.args = "";
+    }
+    parseSchema(entry);
+
+    uint32_t slot = hashName(command->name) & (HASH_TABLE_SIZE - 1);
+    while (hashTable[slot] != -1) {
+        slot = (slot + 1) & (HASH_TABLE_SIZE - 1);
+    }
+    hashTable[slot] = numEntries;
+    numEntries++;
+    pthread_rwlock_unlock(&tableLock);
+}
+
+void UdpCommands_registerAll(const UdpCommands_command_t *commands, int count) {
+    for (int i = 0; i < count; i++) {
+        UdpCommands_register(&commands[i]);
+    }
+}
+
+static bool matchesAlternative(const char *value, const char *alternative, size_t length) {
+    if (length == 3 && strncmp(alternative, "int", 3) == 0) {
+        int parsed;
+        return UdpCommands_parseInt(value, &parsed);
+    }
+    if (length == 3 && strncmp(alternative, "num", 3) == 0) {
+        char *end;
+        strtod(value, &end);
+        return end != value && *end == '\0';
+    }
+    if (length == 4 && strncmp(alternative, "word", 4) == 0) {
+        return true;
+    }
+    return strlen(value) == length && strncmp(value, alternative, length) == 0;
+}
+
+static bool matchesSpec(const char *value, const char *spec) {
+    while (true) {
+        const char *bar = strchr(spec, '|');
+        size_t length = bar ? (size_t)(bar - spec) : strlen(spec);
+        if (matchesAlternative(value, spec, length)) {
+            return true;
+        }
+        if (!bar) {
+            return false;
+        }
+        spec = bar + 1;
+    }
+}
+
+bool UdpCommands_parseInt(const char *text, int *value) {
+    char *end;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX) {
+        return false;
+    }
+    *value = (int)parsed;
+    return true;
+}
+
+void UdpCommands_dispatch(UdpCommands_context_t *ctx, char *line) {
+    assert(isInitialized);
+
+    // Split into words; one word too many is enough to fail validation below
+    char *savePtr = NULL;
+    ctx->argc = 0;
+    char *word = strtok_r(line, " \t", &savePtr);
+    while (word && ctx->argc <= UDP_COMMANDS_MAX_ARGS) {
+        ctx->argv[ctx->argc++] = word;
+        word = strtok_r(NULL, " \t", &savePtr);
+    }
+    if (ctx->argc == 0) {
+        UdpCommands_send(ctx, unknownCommandReply.text, unknownCommandReply.length);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&tableLock);
+    const entry_t *entry = findEntry(ctx->argv[0]);
+    UdpCommands_command_t command;
+    bool valid = false;
+    if (entry) {
+        command = entry->command;
+        int numArgs = ctx->argc - 1;
+        valid = numArgs >= entry->numRequired && numArgs <= entry->numArgs;
+        for (int i = 0; valid && i < numArgs; i++) {
+            valid = matchesSpec(ctx->argv[i + 1], entry->args[i].spec);
+        }
+    }
+    pthread_rwlock_unlock(&tableLock);
+
+    if (!entry) {
+        UdpCommands_send(ctx, unknownCommandReply.text, unknownCommandReply.length);
+    } else if (!valid) {
+        UdpCommands_replyf(ctx, "Invalid arguments. Usage: %s%s%s\n",
+            command.name, command.args[0] ? " " : "", command.args);
+    } else {
+        command.handler(ctx);
+        UdpCommands_flush(ctx);
+    }
+}
+
+void UdpCommands_formatHelp(char *buffer, size_t size) {
+    assert(isInitialized);
+    size_t offset = snprintf(buffer, size, "\nAccepted command examples:\n");
+
+    pthread_rwlock_rdlock(&tableLock);
+    for (int i = 0; i < numEntries && offset < size; i++) {
+        const UdpCommands_command_t *command = &entries[i].command;
+        if (!command->help) {
+            continue;
+        }
+        offset += snprintf(buffer + offset, size - offset, "%s%s%s -- %s\n",
+            command->name, command->args[0] ? " " : "", command->args, command->help);
+    }
+    pthread_rwlock_unlock(&tableLock);
+
+    if (offset < size) {
+        snprintf(buffer + offset, size - offset, "<enter> -- repeat last command.\n");
+    }
+}
+
+void UdpCommands_send(UdpCommands_context_t *ctx, const void *data, size_t length) {
+    sendto(ctx->sockfd, data, length, 0, (const struct sockaddr*)ctx->addr, sizeof(*ctx->addr));
+}
+
+void UdpCommands_reply(UdpCommands_context_t *ctx, const char *text) {
+    UdpCommands_send(ctx, text, strlen(text));
+}
+
+void UdpCommands_replyf(UdpCommands_context_t *ctx, const char *format, ...) {
+    char response[REPLY_BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(response, sizeof(response), format, args);
+    va_end(args);
+    UdpCommands_reply(ctx, response);
+}
+
+// Copies, so handlers may queue stack buffers; the address is the request's,
+// which lives until the flush after the handler
+void UdpCommands_queue(UdpCommands_context_t *ctx, const void *data, size_t length) {
+    const struct sockaddr *addr = (const struct sockaddr*)ctx->addr;
+    if (UdpBatch_addCopy(ctx->batch, data, length, addr, sizeof(*ctx->addr))) {
+        return;
+    }
+    UdpBatch_send(ctx->batch, ctx->sockfd);
+    if (!UdpBatch_addCopy(ctx->batch, data, length, addr, sizeof(*ctx->addr))) {
+        UdpCommands_send(ctx, data, length); // Larger than the batch can hold
+    }
+}
+
+void UdpCommands_flush(UdpCommands_context_t *ctx) {
+    if (UdpBatch_size(ctx->batch) > 0) {
+        UdpBatch_send(ctx->batch, ctx->sockfd);
+    }
+}
@@ -0,0 +1,89 @@
+/* udp_format.c
+ *
+ * This file implements the snprintf()-free reply formatter. Integers are
+ * written two digits at a time from a lookup table and voltages never touch
+ * floating point: a reading is scaled to millivolts once and printed as
+ * "<volts>.<three digits>".
+ */
+
+#include "hal/udp_format.h"
+#include <string.h>
+
+#define ADC_FULL_SCALE 4096
+#define ADC_REFERENCE_MV 3300
+
+static _Thread_local char arena[UDP_FORMAT_ARENA_SIZE];
+
+static const char digitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+
+char* UdpFormat_getArena(void) {
+    return arena;
+}
+
+uint32_t UdpFormat_adcToMillivolts(uint16_t reading) {
+    // Exact halves round down: the double 3.3 is slightly below 3.3, so this
+    // matches printf("%.3f", reading * 3.3 / 4096) for every 12-bit reading
+    return ((uint32_t)reading * ADC_REFERENCE_MV + ADC_FULL_SCALE / 2 - 1) / ADC_FULL_SCALE;
+}
+
+char* UdpFormat_putVolts(char *p, uint32_t millivolts) {
+    p = UdpFormat_putUint(p, millivolts / 1000);
+    uint32_t fraction = millivolts % 1000;
+    *p++ = '.';
+    *p++ = '0' + fraction / 100;
+    memcpy(p, &digitPairs[(fraction % 100) * 2], 2);
+    return p + 2;
+}
+
+char* UdpFormat_putUint(char *p, uint64_t value) {
+    // Build backwards in a scratch buffer, then copy the digits into place
+    char digits[UDP_FORMAT_MAX_UINT_LENGTH];
+    char *end = digits + sizeof(digits);
+    char *d = end;
+
+    while (value >= 100) {
+        d -= 2;
+        memcpy(d, &digitPairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        d -= 2;
+        memcpy(d, &digitPairs[value * 2], 2);
+    } else {
+        *--d = '0' + value;
+    }
+
+    memcpy(p, d, end - d);
+    return p + (end - d);
+}
+
+char* UdpFormat_putInt(char *p, int64_t value) {
+    if (value < 0) {
+        *p++ = '-';
+        return UdpFormat_putUint(p, -(uint64_t)value);
+    }
+    return UdpFormat_putUint(p, (uint64_t)value);
+}
+
+char* UdpFormat_putText(char *p, const UdpFormat_template_t *text) {
+    memcpy(p, text->text, text->length);
+    return p + text->length;
+}
+
+char* UdpFormat_putTemplate(char *p, const UdpFormat_template_t *prefix, int64_t value) {
+    p = UdpFormat_putText(p, prefix);
+    p = UdpFormat_putInt(p, value);
+    *p++ = '\n';
+    return p;
+}
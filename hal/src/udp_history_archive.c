@@ -0,0 +1,92 @@
+/* udp_history_archive.c
+ *
+ * This file implements the binary history archive as a ring of slots per
+ * encoding, indexed by epoch modulo the depth, so a new second simply
+ * overwrites the one UDP_HISTORY_ARCHIVE_DEPTH seconds older.
+ */
+
+#include "hal/udp_history_archive.h"
+#include "hal/udp_commands.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+typedef struct {
+    bool valid;
+    uint32_t epoch;
+    int numDatagrams;
+    UdpProtocol_datagram_t datagrams[UDP_PROTOCOL_MAX_HISTORY_DATAGRAMS];
+} slot_t;
+
+static slot_t slots[2][UDP_HISTORY_ARCHIVE_DEPTH]; // [raw, delta][epoch % depth]
+static bool isInitialized = false;
+static pthread_mutex_t archiveMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function Prototypes
+static void onResend(UdpCommands_context_t *ctx);
+
+static const UdpCommands_command_t archiveCommands[] = {
+    { "resend", "<epoch:int> <chunk:int> [delta]", "send one chunk of a recent bhistory reply again.", onResend },
+};
+
+
+void UdpHistoryArchive_init(void) {
+    assert(!isInitialized);
+    memset(slots, 0, sizeof(slots));
+    isInitialized = true;
+    UdpCommands_registerAll(archiveCommands, sizeof(archiveCommands) / sizeof(archiveCommands[0]));
+}
+
+void UdpHistoryArchive_cleanup(void) {
+    assert(isInitialized);
+    isInitialized = false;
+}
+
+void UdpHistoryArchive_store(
+    uint32_t epoch,
+    bool useDelta,
+    const UdpProtocol_datagram_t *datagrams,
+    int numDatagrams
+) {
+    assert(isInitialized);
+    assert(numDatagrams <= UDP_PROTOCOL_MAX_HISTORY_DATAGRAMS);
+
+    pthread_mutex_lock(&archiveMutex);
+    slot_t *slot = &slots[useDelta][epoch % UDP_HISTORY_ARCHIVE_DEPTH];
+    if (!slot->valid || slot->epoch != epoch) {
+        slot->valid = true;
+        slot->epoch = epoch;
+        slot->numDatagrams = numDatagrams;
+        memcpy(slot->datagrams, datagrams, numDatagrams * sizeof(datagrams[0]));
+    }
+    pthread_mutex_unlock(&archiveMutex);
+}
+
+bool UdpHistoryArchive_get(uint32_t epoch, bool useDelta, int chunk, UdpProtocol_datagram_t *datagram) {
+    assert(isInitialized);
+    bool found = false;
+
+    pthread_mutex_lock(&archiveMutex);
+    const slot_t *slot = &slots[useDelta][epoch % UDP_HISTORY_ARCHIVE_DEPTH];
+    if (slot->valid && slot->epoch == epoch && chunk >= 0 && chunk < slot->numDatagrams) {
+        *datagram = slot->datagrams[chunk];
+        found = true;
+    }
+    pthread_mutex_unlock(&archiveMutex);
+
+    return found;
+}
+
+static void onResend(UdpCommands_context_t *ctx) {
+    UdpProtocol_datagram_t datagram;
+    uint32_t epoch = (uint32_t)strtoul(ctx->argv[1], NULL, 10);
+    int chunk = atoi(ctx->argv[2]);
+    bool useDelta = ctx->argc > 3;
+
+    if (UdpHistoryArchive_get(epoch, useDelta, chunk, &datagram)) {
+        UdpCommands_send(ctx, datagram.data, datagram.length);
+    } else {
+        UdpCommands_reply(ctx, "Chunk not available.\n");
+    }
+}
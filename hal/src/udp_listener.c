@@ -1,172 +1,573 @@
 /* udp_listner.c
  * This file implements a UDP listener that listens for commands from a client and responds with the requested data.
- * The listener listens on port 12345 and supports the following commands:
+ * The listener listens on port 12345 (IPv6 and IPv4) and supports the following commands:
  * - help: list of commands and summary
  * - count: Return the total number of light samples taken so far
  * - length: Return how many samples were captured during the previous second
  * - dips: Return how many dips were detected during the previous second’s samples
- * - history: Return all the data samples from the previous second
+ * - history [start] [count] [every]: Return the data samples from the previous second,
+ *   optionally a range of them and only every Nth one
+ * - history minmax N: Return the min and max of N equal buckets of the previous second
+ * - bhistory [delta]: Binary version of history (see udp_protocol.h)
+ * - bstats: Binary statistics of the previous second
+ * - resend <epoch> <chunk> [delta]: Resend one lost bhistory chunk (see udp_history_archive.h)
+ * - subscribe [seconds]: Push binary stats and history every second (see udp_subscriptions.h)
+ * - unsubscribe: Stop the pushes
  * - stop: Exit the program
- * The listener runs in a separate thread and uses the Sampler module to get the required data.
+ * An epoll event loop thread drains the socket into a bounded request queue and a small
+ * pool of worker threads handles the requests, each with its own reply buffers. The same
+ * loop handles shutdown (eventfd, signalfd) and subscription pushes. Per-client state
+ * (such as the last command) and the per-host rate limit live in the session table
+ * (see udp_sessions.h), so several monitoring stations can poll the board at the same
+ * time. Replies that only change once per second (length, dips and
+ * the history variants) are built once per second and then sent from the reply cache
+ * (see udp_reply_cache.h); count and bstats stay live. Commands are looked up in the
+ * command table (see udp_commands.h), where other modules register their own.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include "hal/udp_listener.h"
 #include "hal/light_sensor.h"
 #include "hal/rotary_encoder_statemachine.h"
 #include "hal/pwm_rotary.h"
 #include "hal/lcd.h"
+#include "hal/udp_protocol.h"
+#include "hal/udp_subscriptions.h"
+#include "hal/udp_batch.h"
+#include "hal/udp_sessions.h"
+#include "hal/udp_commands.h"
+#include "hal/udp_format.h"
+#include "hal/udp_reply_cache.h"
+#include "hal/udp_history_archive.h"
+#include "hal/metrics.h"
+#include "hal/params.h"
+#include "hal/i2c_bus.h"
 #include <stdatomic.h> 
 #include <assert.h>
 
 
-#define PORT 12345
 #define BUFFER_SIZE 1024
-#define HELP_BUFFER_SIZE 512
-#define SHORT_BUFFER_SIZE 64
-#define MAX_UDP_BUFFER_SIZE 1500
+#define HELP_BUFFER_SIZE 2048
+#define PARAM_LINE_SIZE 160
+#define HISTORY_VALUES_PER_LINE 10
+#define MAX_MINMAX_BUCKETS (MAX_HISTORY_SIZE / 2)  // Two values per bucket
+#define NUM_WORKER_THREADS 2
+#define REQUEST_QUEUE_SIZE 128 // Several clients' full bursts (see udp_sessions.h)
+#define MAX_EPOLL_EVENTS 8
+
+// epoll data tags
+enum {
+    EVENT_SOCKET,
+    EVENT_STOP,
+    EVENT_SIGNAL,
+    EVENT_PUBLISH,
+};
+
+typedef struct {
+    struct sockaddr_in6 addr;
+    int64_t receivedUs;  // For the queue wait metric
+    char command[BUFFER_SIZE];
+} request_t;
+
+// Everything a worker thread replies with; no other thread touches it
+typedef struct {
+    pthread_t thread;
+    struct UdpBatch *batch;
+    uint16_t samples[MAX_HISTORY_SIZE];
+    UdpProtocol_datagram_t datagrams[UDP_PROTOCOL_MAX_HISTORY_DATAGRAMS];
+} worker_t;
+
+// Arguments of `history`: a range with decimation, or a min/max envelope
+typedef struct {
+    int start;
+    int count;
+    int every;
+    int minMaxBuckets;  // 0 for a range query
+} historyQuery_t;
+
+// Text history being written into a reply cache entry
+typedef struct {
+    char *lineStart;
+    char *p;
+    int valuesOnLine;
+} historyText_t;
 
 static pthread_t udp_thread;
 static int sockfd;
-static struct sockaddr_in server_addr, client_addr;
-static socklen_t addr_len = sizeof(client_addr);
-static char *last_command = NULL;
+static int epollFd = -1;
+static int stopEventFd = -1;
+static int signalFd = -1;
+static struct sockaddr_in6 server_addr;
+static worker_t workers[NUM_WORKER_THREADS];
 static bool isInitialized = false;
 
+// Requests waiting for a worker
+static request_t requestQueue[REQUEST_QUEUE_SIZE];
+static int queueHead = 0;
+static int queueCount = 0;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requestReady = PTHREAD_COND_INITIALIZER;
+
 static volatile atomic_bool running = true;
 
+// The worker running on this thread, for the reply cache builders, which only
+// get the request (live text replies are built in the thread's UdpFormat arena)
+static _Thread_local worker_t *currentWorker = NULL;
+
+_Static_assert(REQUEST_QUEUE_SIZE >= 2 * UDP_SESSIONS_BURST,
+    "one client's burst must not be able to fill the request queue");
+_Static_assert(MAX_HISTORY_SIZE * (UDP_FORMAT_MAX_VOLTS_LENGTH + 2) <= UDP_REPLY_CACHE_DATA_SIZE,
+    "text history does not fit in a reply cache entry");
+
+static const UdpFormat_template_t countTemplate = UDP_FORMAT_TEMPLATE("# samples taken total: ");
+static const UdpFormat_template_t lengthTemplate = UDP_FORMAT_TEMPLATE("# samples taken last second: ");
+static const UdpFormat_template_t dipsTemplate = UDP_FORMAT_TEMPLATE("# Dips: ");
+static const UdpFormat_template_t stopReply = UDP_FORMAT_TEMPLATE("Program terminating.\n");
+
 //Prototype
 static void* udp_listener_thread(void* arg);
+static void* udp_worker_thread(void* arg);
+static void handleRequest(worker_t *worker, request_t *request);
+static bool parseHistoryQuery(const UdpCommands_context_t *ctx, historyQuery_t *query);
+static void putHistoryValue(UdpReplyCache_reply_t *reply, historyText_t *text, uint16_t sample);
+static void endHistoryLine(UdpReplyCache_reply_t *reply, historyText_t *text);
+static void receiveRequests(void);
+static void addToEpoll(int fd, uint32_t tag);
 void UdpListener_init(void);
 void UdpListener_cleanup(void);
 bool UdpListener_isRunning(void);
+void UdpListener_stop(void);
+
+static void addToEpoll(int fd, uint32_t tag) {
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = tag };
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("Unable to add fd to epoll");
+        exit(EXIT_FAILURE);
+    }
+}
 
+// Event loop thread: never blocks on anything but epoll_wait(), so a stop
+// request or signal is seen immediately
 void* udp_listener_thread(void* arg) {
     (void)arg; // Suppress unused parameter warning
-    char buffer[BUFFER_SIZE];
-    ssize_t received_len;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
 
     while (running) {
-        received_len = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr*)&client_addr, &addr_len);
-        if (received_len < 0) {
-            perror("Receive failed");
-            continue;
+        int numEvents = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+        if (numEvents < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
         }
-        if (received_len < BUFFER_SIZE) {
-            buffer[received_len] = '\0';
-            buffer[strcspn(buffer, "\r\n")] = '\0';  // Strip trailing newline or carriage return
+
+        for (int i = 0; i < numEvents && running; i++) {
+            uint32_t tag = events[i].data.u32;
+            if (tag == EVENT_SOCKET) {
+                receiveRequests();
+            } else if (tag == EVENT_STOP) {
+                // running already cleared by UdpListener_stop()
+            } else if (tag == EVENT_SIGNAL) {
+                struct signalfd_siginfo info;
+                if (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+                    printf("Received signal %d, terminating.\n", (int)info.ssi_signo);
+                }
+                UdpListener_stop();
+            } else if (tag == EVENT_PUBLISH) {
+                UdpSubscriptions_publishPending();
+            }
         }
+    }
+
+    // Wake the workers so they see running == false
+    pthread_mutex_lock(&queueMutex);
+    pthread_cond_broadcast(&requestReady);
+    pthread_mutex_unlock(&queueMutex);
+    return NULL;
+}
 
-        if (strlen(buffer) == 0) {
-            if (last_command == NULL) {
-                sendto(sockfd, "Unknown command. Type 'help' for a list of commands.\n", 53, 0, (struct sockaddr*)&client_addr, addr_len);
-                continue;
+// Drain every waiting datagram into the request queue for the workers
+static void receiveRequests(void) {
+    request_t request;
+
+    while (true) {
+        socklen_t addr_len = sizeof(request.addr);
+        ssize_t received_len = recvfrom(sockfd, request.command, BUFFER_SIZE - 1, 0, (struct sockaddr*)&request.addr, &addr_len);
+        if (received_len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Receive failed");
             }
-            strncpy(buffer, last_command, sizeof(buffer) - 1); // Use the last valid command
-            buffer[sizeof(buffer) - 1] = '\0';  // Ensure null-termination
+            return;
+        }
+        request.command[received_len] = '\0';
+        request.command[strcspn(request.command, "\r\n")] = '\0';  // Strip trailing newline or carriage return
+        request.receivedUs = Metrics_nowInUs();
+
+        // Rate limit before queueing, so a flooding client cannot take the
+        // queue slots other clients' requests need
+        if (!UdpSessions_admitRequest(&request.addr)) {
+            Metrics_add(METRICS_UDP_RATE_LIMITED, 1);
+            continue; // Over its rate limit: drop silently rather than amplify a flood
+        }
+
+        pthread_mutex_lock(&queueMutex);
+        if (queueCount < REQUEST_QUEUE_SIZE) {
+            requestQueue[(queueHead + queueCount) % REQUEST_QUEUE_SIZE] = request;
+            queueCount++;
+            pthread_cond_signal(&requestReady);
         } else {
-            free(last_command);
-            last_command = strdup(buffer);  // Store last valid command
+            // All workers busy and queue full, drop it like the network would
+            Metrics_add(METRICS_UDP_QUEUE_FULL, 1);
         }
+        pthread_mutex_unlock(&queueMutex);
+    }
+}
 
-        // printf("Received command: %s\n", buffer);
-
-        if (strcmp(buffer, "help") == 0 || strcmp(buffer, "?") == 0) {
-            char response[HELP_BUFFER_SIZE];
-            snprintf(response, sizeof(response), 
-                    "\nAccepted command examples:\n"
-                    "count -- get the total number of samples taken.\n"
-                    "length -- get the number of samples taken in the previously completed second.\n"
-                    "dips -- get the number of dips in the previously completed second.\n"
-                    "history -- get all the samples in the previously completed second.\n"
-                    "stop -- cause the server program to end.\n"
-                    "<enter> -- repeat last command.\n");
-
-            sendto(sockfd, response, strlen(response), 0, (const struct sockaddr *)&client_addr, addr_len);
-                
-        } else if (strcmp(buffer, "count") == 0) {
-            char response[SHORT_BUFFER_SIZE];
-            snprintf(response, sizeof(response), "# samples taken total: %lld\n", Sampler_getNumSamplesTaken());
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr*)&client_addr, addr_len);
-
-        } else if (strcmp(buffer, "length") == 0) {
-            char response[SHORT_BUFFER_SIZE];
-            snprintf(response, sizeof(response), "# samples taken last second: %d\n", Sampler_getHistorySize());
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr*)&client_addr, addr_len);
-
-        } else if (strcmp(buffer, "dips") == 0) {
-            char response[SHORT_BUFFER_SIZE];
-            snprintf(response, sizeof(response), "# Dips: %d\n", Sampler_getDipCount());
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr*)&client_addr, addr_len);
-
-        } else if (strcmp(buffer, "history") == 0) {
-            int size = 0;
-            double* history = Sampler_getHistory(&size);
-
-            if (history) {
-                char response[MAX_UDP_BUFFER_SIZE];  
-                int offset = 0;
-                int line_count = 0;  // Track numbers per packet
-
-                for (int i = 0; i < size; i++) {
-                    double voltage = (3.3 / 4096) * history[i];  //conver ADC value to volage, 12 bit ADC with 3.3V reference
-                    int written = snprintf(response + offset, sizeof(response) - offset, "%.3f, ", voltage);
-
-                    if (written < 0 || (size_t)(offset + written) >= sizeof(response) - 1) {
-                        // Handle buffer overflow (shouldn't happen in the new logic)
-                        break;
-                    }
-
-                    offset += written;
-                    line_count++;
-
-                    // Send only when exactly 10 values are collected
-                    if (line_count == 10) {
-                        response[offset - 2] = '\n';  // Replace last comma with newline
-                        sendto(sockfd, response, offset - 1, 0, (struct sockaddr*)&client_addr, addr_len);
-                        offset = 0;  // Reset buffer
-                        line_count = 0; // Reset counter
-                    }
-                }
+static void* udp_worker_thread(void* arg) {
+    worker_t *worker = (worker_t*)arg;
+    request_t request;
+    currentWorker = worker;
 
-                // If leftover values exist (less than 10), 
-                if (line_count > 0) {
-                    response[offset - 2] = '\n';  
-                    sendto(sockfd, response, offset - 1, 0, (struct sockaddr*)&client_addr, addr_len);
-                }
+    while (true) {
+        pthread_mutex_lock(&queueMutex);
+        while (running && queueCount == 0) {
+            pthread_cond_wait(&requestReady, &queueMutex);
+        }
+        if (!running) {
+            pthread_mutex_unlock(&queueMutex);
+            break;
+        }
+        request = requestQueue[queueHead];
+        queueHead = (queueHead + 1) % REQUEST_QUEUE_SIZE;
+        queueCount--;
+        pthread_mutex_unlock(&queueMutex);
+
+        int64_t startUs = Metrics_nowInUs();
+        Metrics_observe(METRICS_UDP_QUEUE_WAIT_US, startUs - request.receivedUs);
+        handleRequest(worker, &request);
+        Metrics_observe(METRICS_UDP_HANDLE_US, Metrics_nowInUs() - startUs);
+        Metrics_add(METRICS_UDP_REQUESTS, 1);
+    }
+    return NULL;
+}
+
+static void handleRequest(worker_t *worker, request_t *request) {
+    UdpCommands_context_t ctx = {
+        .sockfd = sockfd,
+        .addr = &request->addr,
+        .batch = worker->batch,
+    };
+
+    if (!UdpSessions_resolveCommand(&request->addr, request->command, sizeof(request->command))) {
+        UdpCommands_reply(&ctx, "Unknown command. Type 'help' for a list of commands.\n");
+        return;
+    }
+
+    // printf("Received command: %s\n", request->command);
+    UdpCommands_dispatch(&ctx, request->command);
+}
+
+static void onHelp(UdpCommands_context_t *ctx) {
+    char response[HELP_BUFFER_SIZE];
+    UdpCommands_formatHelp(response, sizeof(response));
+    UdpCommands_reply(ctx, response);
+}
+
+static void onCount(UdpCommands_context_t *ctx) {
+    char *reply = UdpFormat_getArena();
+    char *end = UdpFormat_putTemplate(reply, &countTemplate, Sampler_getNumSamplesTaken());
+    UdpCommands_send(ctx, reply, end - reply);
+}
+
+// Read the epoch first: if the sampler rolls over midway, the reply is
+// labelled with the older epoch and simply rebuilt on the next request
+static void buildLength(UdpReplyCache_reply_t *reply, UdpCommands_context_t *ctx) {
+    (void)ctx;
+    reply->epoch = Sampler_getHistoryEpoch();
+    char *start = reply->data + reply->used;
+    char *end = UdpFormat_putTemplate(start, &lengthTemplate, Sampler_getHistorySize());
+    UdpReplyCache_commit(reply, end - start);
+}
+
+static void buildDips(UdpReplyCache_reply_t *reply, UdpCommands_context_t *ctx) {
+    (void)ctx;
+    reply->epoch = Sampler_getHistoryEpoch();
+    char *start = reply->data + reply->used;
+    char *end = UdpFormat_putTemplate(start, &dipsTemplate, Sampler_getDipCount());
+    UdpReplyCache_commit(reply, end - start);
+}
+
+static void onLength(UdpCommands_context_t *ctx) {
+    UdpReplyCache_serve(ctx, buildLength);
+}
+
+static void onDips(UdpCommands_context_t *ctx) {
+    UdpReplyCache_serve(ctx, buildDips);
+}
+
+// Parse the arguments of `history`; false if they are out of range
+static bool parseHistoryQuery(const UdpCommands_context_t *ctx, historyQuery_t *query) {
+    query->minMaxBuckets = 0;
+    query->start = 0;
+    query->count = MAX_HISTORY_SIZE;
+    query->every = 1;
+
+    if (ctx->argc > 1 && strcmp(ctx->argv[1], "minmax") == 0) {
+        if (ctx->argc != 3) {
+            return false;
+        }
+        query->minMaxBuckets = atoi(ctx->argv[2]);
+        return query->minMaxBuckets >= 1 && query->minMaxBuckets <= MAX_MINMAX_BUCKETS;
+    }
+    if (ctx->argc > 1) query->start = atoi(ctx->argv[1]);
+    if (ctx->argc > 2) query->count = atoi(ctx->argv[2]);
+    if (ctx->argc > 3) query->every = atoi(ctx->argv[3]);
+    return query->start >= 0 && query->count >= 0 && query->every >= 1;
+}
+
+// Append one value to the text reply; every 10 values make a line, and each
+// line is one datagram written straight into the cache
+static void putHistoryValue(UdpReplyCache_reply_t *reply, historyText_t *text, uint16_t sample) {
+    if (text->valuesOnLine > 0) {
+        *text->p++ = ',';
+        *text->p++ = ' ';
+    }
+    text->p = UdpFormat_putVolts(text->p, UdpFormat_adcToMillivolts(sample));
+    if (++text->valuesOnLine == HISTORY_VALUES_PER_LINE) {
+        endHistoryLine(reply, text);
+    }
+}
+
+static void endHistoryLine(UdpReplyCache_reply_t *reply, historyText_t *text) {
+    if (text->valuesOnLine > 0) {
+        *text->p++ = '\n';
+        UdpReplyCache_commit(reply, text->p - text->lineStart);
+        text->lineStart = text->p;
+        text->valuesOnLine = 0;
+    }
+}
 
-                free(history);
+static void buildHistory(UdpReplyCache_reply_t *reply, UdpCommands_context_t *ctx) {
+    historyQuery_t query;
+    parseHistoryQuery(ctx, &query);  // Already validated by onHistory()
+    assert(currentWorker); // Builders run on the worker serving the request
+    uint16_t *samples = currentWorker->samples;
+    int size = Sampler_getHistoryRaw(samples, MAX_HISTORY_SIZE, &reply->epoch);
+
+    historyText_t text;
+    text.lineStart = reply->data + reply->used;
+    text.p = text.lineStart;
+    text.valuesOnLine = 0;
+
+    if (query.minMaxBuckets > 0) {
+        // Min/max envelope in one pass: sample i belongs to bucket i * N / size
+        int buckets = query.minMaxBuckets < size ? query.minMaxBuckets : size;
+        int bucket = 0;
+        uint16_t min = UINT16_MAX;
+        uint16_t max = 0;
+        for (int i = 0; i < size; i++) {
+            int sampleBucket = (int)((long)i * buckets / size);
+            if (sampleBucket != bucket) {
+                putHistoryValue(reply, &text, min);
+                putHistoryValue(reply, &text, max);
+                bucket = sampleBucket;
+                min = UINT16_MAX;
+                max = 0;
             }
+            if (samples[i] < min) min = samples[i];
+            if (samples[i] > max) max = samples[i];
+        }
+        if (size > 0) {
+            putHistoryValue(reply, &text, min);
+            putHistoryValue(reply, &text, max);
+        }
+    } else {
+        int end = (query.count < size - query.start) ? query.start + query.count : size;
+        for (int i = query.start; i < end; i += query.every) {
+            putHistoryValue(reply, &text, samples[i]);
+        }
+    }
+    endHistoryLine(reply, &text);
+}
 
-        } else if (strcmp(buffer, "stop") == 0) {
-            sendto(sockfd, "Program terminating.\n", 21, 0, (struct sockaddr*)&client_addr, addr_len); //21 = length of "Program terminating.\n"
-            running = false;  // Signal main thread to exit
-            break;
+static void buildBinaryHistory(UdpReplyCache_reply_t *reply, UdpCommands_context_t *ctx) {
+    worker_t *worker = currentWorker;
+    assert(worker);
+    int size = Sampler_getHistoryRaw(worker->samples, MAX_HISTORY_SIZE, &reply->epoch);
+    bool useDelta = ctx->argc > 1;
 
-        } else {
-            sendto(sockfd, "Unknown command. Type 'help' for a list of commands.\n", 53, 0, (struct sockaddr*)&client_addr, addr_len);
+    int numDatagrams = UdpProtocol_encodeHistory(worker->samples, size, reply->epoch, useDelta,
+        worker->datagrams, UDP_PROTOCOL_MAX_HISTORY_DATAGRAMS);
+    for (int i = 0; i < numDatagrams; i++) {
+        UdpReplyCache_append(reply, worker->datagrams[i].data, worker->datagrams[i].length);
+    }
+    UdpHistoryArchive_store(reply->epoch, useDelta, worker->datagrams, numDatagrams);
+}
+
+static void onHistory(UdpCommands_context_t *ctx) {
+    historyQuery_t query;
+    if (!parseHistoryQuery(ctx, &query)) {
+        UdpCommands_replyf(ctx, "Invalid arguments. Usage: history [start] [count] [every] | history minmax <1-%d>\n",
+            MAX_MINMAX_BUCKETS);
+        return;
+    }
+    UdpReplyCache_serve(ctx, buildHistory);
+}
+
+static void onBinaryHistory(UdpCommands_context_t *ctx) {
+    UdpReplyCache_serve(ctx, buildBinaryHistory);
+}
+
+static void onBinaryStats(UdpCommands_context_t *ctx) {
+    UdpProtocol_stats_t stats;
+    UdpProtocol_datagram_t datagram;
+    UdpProtocol_collectStats(&stats);
+    UdpProtocol_encodeStats(&stats, Sampler_getHistoryEpoch(), &datagram);
+    UdpCommands_send(ctx, datagram.data, datagram.length);
+}
+
+// One "name = value" line per parameter, or just the one asked for
+static void onGet(UdpCommands_context_t *ctx) {
+    char response[PARAMS_COUNT * 2 * PARAM_LINE_SIZE];
+    size_t length = 0;
+    int first = 0;
+    int last = PARAMS_COUNT - 1;
+    if (ctx->argc > 1) {
+        first = last = Params_find(ctx->argv[1]);
+        if (first < 0) {
+            UdpCommands_reply(ctx, "Unknown parameter. Type 'get' for a list of parameters.\n");
+            return;
         }
     }
-    return NULL;
+    for (int id = first; id <= last; id++) {
+        char line[PARAM_LINE_SIZE];
+        char description[PARAM_LINE_SIZE];
+        Params_format(id, line, sizeof(line));
+        Params_describe(id, description, sizeof(description));
+        length += snprintf(response + length, sizeof(response) - length, "%s  (%s)\n", line, description);
+        assert(length < sizeof(response));
+    }
+    UdpCommands_reply(ctx, response);
 }
 
+static void onSet(UdpCommands_context_t *ctx) {
+    int id = Params_find(ctx->argv[1]);
+    if (id < 0) {
+        UdpCommands_reply(ctx, "Unknown parameter. Type 'get' for a list of parameters.\n");
+        return;
+    }
+    if (Params_isStartupOnly(id)) {
+        UdpCommands_replyf(ctx, "%s is only read at startup; set it in %s and restart.\n",
+            ctx->argv[1], PARAMS_CONFIG_FILE);
+        return;
+    }
+    char description[PARAM_LINE_SIZE];
+    if (!Params_setFromString(id, ctx->argv[2])) {
+        Params_describe(id, description, sizeof(description));
+        UdpCommands_replyf(ctx, "Invalid value for %s. Expected %s.\n", ctx->argv[1], description);
+        return;
+    }
+    char line[PARAM_LINE_SIZE];
+    Params_format(id, line, sizeof(line));
+    UdpCommands_replyf(ctx, "%s\n", line);
+}
+
+// Three lines per device: utilisation, latency histogram, traffic and errors
+static void onI2cStats(UdpCommands_context_t *ctx) {
+    static const unsigned long boundsUs[I2C_LATENCY_BUCKETS - 1] = I2C_LATENCY_BOUNDS_US;
+    char response[HELP_BUFFER_SIZE];
+    size_t length = 0;
+    int numDevices = I2cBus_getNumDevices();
+    if (numDevices == 0) {
+        UdpCommands_reply(ctx, "No I2C devices are open.\n");
+        return;
+    }
+
+    for (int device = 0; device < numDevices && length < sizeof(response); device++) {
+        I2c_stats_t stats;
+        if (I2cBus_getStats(device, &stats) < 0) {
+            continue;
+        }
+        double averageUs = stats.transfers ? (double)stats.busyUs / stats.transfers : 0.0;
+        length += snprintf(response + length, sizeof(response) - length,
+            "%s 0x%02x: bus %.1f%% of the last second, %lu transfers\n  latency avg %.1fus max %luus [",
+            I2cBus_getPath(device), stats.address, stats.utilisation * 100.0, stats.transfers,
+            averageUs, stats.maxLatencyUs);
+        for (int i = 0; i < I2C_LATENCY_BUCKETS && length < sizeof(response); i++) {
+            length += (i < I2C_LATENCY_BUCKETS - 1)
+                ? snprintf(response + length, sizeof(response) - length, "%s<=%lu:%lu", i ? " " : "", boundsUs[i], stats.latencyBuckets[i])
+                : snprintf(response + length, sizeof(response) - length, " >%lu:%lu]\n", boundsUs[i - 1], stats.latencyBuckets[i]);
+        }
+        if (length < sizeof(response)) {
+            length += snprintf(response + length, sizeof(response) - length,
+                "  bytes %llu written %llu read, errors %lu, retries %lu, failures %lu\n",
+                stats.bytesWritten, stats.bytesRead, stats.errors, stats.retries, stats.failures);
+        }
+    }
+    UdpCommands_reply(ctx, response);
+}
+
+static void onStop(UdpCommands_context_t *ctx) {
+    UdpCommands_send(ctx, stopReply.text, stopReply.length);
+    UdpListener_stop();  // Signal main thread to exit
+}
+
+static const UdpCommands_command_t listenerCommands[] = {
+    { "help", "", NULL, onHelp },
+    { "?", "", NULL, onHelp },
+    { "count", "", "get the total number of samples taken.", onCount },
+    { "length", "", "get the number of samples taken in the previously completed second.", onLength },
+    { "dips", "", "get the number of dips in the previously completed second.", onDips },
+    { "history", "[start:int|minmax] [count:int] [every:int]",
+        "get the samples in the previously completed second (all, `count` of them from `start` "
+        "keeping every `every`th, or with `minmax N` the min and max of N buckets).", onHistory },
+    { "bhistory", "[delta]", "binary history (packed uint16 or delta encoded samples).", onBinaryHistory },
+    { "bstats", "", "binary statistics of the previously completed second.", onBinaryStats },
+    { "get", "[name:word]", "show a runtime parameter (or all of them) with its range.", onGet },
+    { "set", "<name:word> <value:word>", "change a runtime parameter.", onSet },
+    { "i2c", "", "I2C bus utilisation, latency histogram and errors per device.", onI2cStats },
+};
+
+// Registered after the other modules' commands so it stays last in `help`
+static const UdpCommands_command_t stopCommand =
+    { "stop", "", "cause the server program to end.", onStop };
+
 void UdpListener_init(void) {
     assert(!isInitialized);
     isInitialized = true;
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    // Handle SIGINT/SIGTERM in the event loop; threads created later inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    // Dual stack: IPv4 clients show up as IPv4-mapped addresses (::ffff:a.b.c.d)
+    sockfd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
+    int v6Only = 0;
+    if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only)) < 0) {
+        perror("Unable to enable IPv4 on the IPv6 socket");
+        exit(EXIT_FAILURE);
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin6_family = AF_INET6;
+    server_addr.sin6_addr = in6addr_any;
+    server_addr.sin6_port = htons(Params_getInt(PARAMS_UDP_PORT));
 
     if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
@@ -174,13 +575,46 @@ void UdpListener_init(void) {
         exit(EXIT_FAILURE);
     }
 
+    stopEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (signalFd < 0 || stopEventFd < 0 || epollFd < 0) {
+        perror("Unable to create event loop");
+        exit(EXIT_FAILURE);
+    }
+
+    UdpCommands_init();
+    UdpCommands_registerAll(listenerCommands, sizeof(listenerCommands) / sizeof(listenerCommands[0]));
+    UdpSessions_init();
+    UdpReplyCache_init();
+    UdpHistoryArchive_init();
+    UdpSubscriptions_init(sockfd);
+    UdpCommands_register(&stopCommand);
+    addToEpoll(sockfd, EVENT_SOCKET);
+    addToEpoll(stopEventFd, EVENT_STOP);
+    addToEpoll(signalFd, EVENT_SIGNAL);
+    addToEpoll(UdpSubscriptions_getEventFd(), EVENT_PUBLISH);
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        workers[i].batch = UdpBatch_create();
+        pthread_create(&workers[i].thread, NULL, udp_worker_thread, &workers[i]);
+    }
     pthread_create(&udp_thread, NULL, udp_listener_thread, NULL);
 }
 
 void UdpListener_cleanup(void) {
     assert(isInitialized);
     pthread_join(udp_thread, NULL);
-    free(last_command);
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        pthread_join(workers[i].thread, NULL);
+        UdpBatch_destroy(workers[i].batch);
+    }
+    UdpSubscriptions_cleanup();
+    UdpHistoryArchive_cleanup();
+    UdpReplyCache_cleanup();
+    UdpSessions_cleanup();
+    UdpCommands_cleanup();
+    close(epollFd);
+    close(stopEventFd);
+    close(signalFd);
     close(sockfd);
 }
 
@@ -190,3 +624,11 @@ bool UdpListener_isRunning(void) {
     return running;
 }
 
+void UdpListener_stop(void) {
+    assert(isInitialized);
+    running = false;
+    uint64_t one = 1;
+    if (write(stopEventFd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Unable to signal stop");
+    }
+}
@@ -0,0 +1,155 @@
+/* udp_protocol.c
+ *
+ * This file encodes history samples and statistics into the binary UDP
+ * datagrams described in udp_protocol.h. Values are written byte by byte in
+ * big-endian order so the layout does not depend on struct packing.
+ */
+
+#include "hal/udp_protocol.h"
+#include "hal/pwm_rotary.h"
+#include <stdatomic.h>
+#include <assert.h>
+
+#define MAX_PAYLOAD (UDP_PROTOCOL_MAX_DATAGRAM - UDP_PROTOCOL_HEADER_SIZE)
+
+// Shared by every reply so clients can spot lost or reordered datagrams
+static atomic_uint sequence = 0;
+
+static uint8_t* put16(uint8_t *p, uint16_t value) {
+    p[0] = (value >> 8) & 0xFF;
+    p[1] = value & 0xFF;
+    return p + 2;
+}
+
+static uint8_t* put32(uint8_t *p, uint32_t value) {
+    p = put16(p, (value >> 16) & 0xFFFF);
+    return put16(p, value & 0xFFFF);
+}
+
+static void writeHeader(
+    UdpProtocol_datagram_t *datagram,
+    enum UdpProtocol_messageType type,
+    uint8_t flags,
+    int chunkIndex,
+    uint32_t epoch,
+    int firstSample,
+    int sampleCount
+) {
+    uint8_t *p = datagram->data;
+    p = put16(p, UDP_PROTOCOL_MAGIC);
+    *p++ = UDP_PROTOCOL_VERSION;
+    *p++ = (uint8_t)type;
+    *p++ = flags;
+    *p++ = (uint8_t)chunkIndex;
+    *p++ = 1; // Chunk count, patched once the whole reply is encoded
+    *p++ = 0;
+    p = put32(p, atomic_fetch_add(&sequence, 1));
+    p = put32(p, epoch);
+    p = put16(p, (uint16_t)firstSample);
+    put16(p, (uint16_t)sampleCount);
+}
+
+// Fill one datagram starting at samples[first]; returns how many samples fit.
+static int encodeChunk(
+    const uint16_t *samples,
+    int first,
+    int count,
+    bool useDelta,
+    uint8_t *payload,
+    int *payloadLength
+) {
+    uint8_t *p = payload;
+    uint8_t *end = payload + MAX_PAYLOAD;
+    int i = first;
+
+    if (!useDelta) {
+        for (; i < count && p + 2 <= end; i++) {
+            p = put16(p, samples[i]);
+        }
+    } else {
+        // First sample is always absolute so each datagram decodes on its own
+        p = put16(p, samples[i++]);
+        for (; i < count; i++) {
+            int delta = (int)samples[i] - (int)samples[i - 1];
+            if (delta > -UDP_PROTOCOL_DELTA_ESCAPE && delta < UDP_PROTOCOL_DELTA_ESCAPE) {
+                if (p + 1 > end) break;
+                *p++ = (uint8_t)(int8_t)delta;
+            } else {
+                if (p + 3 > end) break;
+                *p++ = UDP_PROTOCOL_DELTA_ESCAPE;
+                p = put16(p, samples[i]);
+            }
+        }
+    }
+
+    *payloadLength = p - payload;
+    return i - first;
+}
+
+void UdpProtocol_collectStats(UdpProtocol_stats_t *stats) {
+    Period_statistics_t period;
+    Sampler_getPeriodStatistics(&period);
+
+    stats->samplesTotal = (uint64_t)Sampler_getNumSamplesTaken();
+    stats->samplesLastSecond = (uint32_t)Sampler_getHistorySize();
+    stats->dips = (uint32_t)Sampler_getDipCount();
+    stats->averageMillivolts = (uint32_t)(Sampler_getAverageReading() * (3.3 / 4096) * 1000.0 + 0.5);
+    stats->pwmFrequencyHz = (uint32_t)PwmRotary_getFrequency();
+    stats->minPeriodInUs = (uint32_t)(period.minPeriodInMs * 1000.0);
+    stats->maxPeriodInUs = (uint32_t)(period.maxPeriodInMs * 1000.0);
+    stats->avgPeriodInUs = (uint32_t)(period.avgPeriodInMs * 1000.0);
+}
+
+int UdpProtocol_encodeHistory(
+    const uint16_t *samples,
+    int count,
+    uint32_t epoch,
+    bool useDelta,
+    UdpProtocol_datagram_t *datagrams,
+    int maxDatagrams
+) {
+    assert(count >= 0);
+    assert(maxDatagrams > 0);
+    uint8_t flags = useDelta ? UDP_PROTOCOL_FLAG_DELTA : 0;
+
+    int numDatagrams = 0;
+    int first = 0;
+    do {
+        UdpProtocol_datagram_t *datagram = &datagrams[numDatagrams];
+        int payloadLength = 0;
+        int encoded = 0;
+        if (first < count) {
+            encoded = encodeChunk(samples, first, count, useDelta,
+                datagram->data + UDP_PROTOCOL_HEADER_SIZE, &payloadLength);
+        }
+        writeHeader(datagram, UDP_PROTOCOL_MSG_HISTORY, flags, numDatagrams, epoch, first, encoded);
+        datagram->length = UDP_PROTOCOL_HEADER_SIZE + payloadLength;
+        first += encoded;
+        numDatagrams++;
+    } while (first < count && numDatagrams < maxDatagrams);
+
+    for (int i = 0; i < numDatagrams; i++) {
+        datagrams[i].data[6] = (uint8_t)numDatagrams;
+    }
+    return numDatagrams;
+}
+
+void UdpProtocol_encodeStats(
+    const UdpProtocol_stats_t *stats,
+    uint32_t epoch,
+    UdpProtocol_datagram_t *datagram
+) {
+    writeHeader(datagram, UDP_PROTOCOL_MSG_STATS, 0, 0, epoch, 0, 0);
+
+    uint8_t *p = datagram->data + UDP_PROTOCOL_HEADER_SIZE;
+    p = put32(p, (uint32_t)(stats->samplesTotal >> 32));
+    p = put32(p, (uint32_t)(stats->samplesTotal & 0xFFFFFFFF));
+    p = put32(p, stats->samplesLastSecond);
+    p = put32(p, stats->dips);
+    p = put32(p, stats->averageMillivolts);
+    p = put32(p, stats->pwmFrequencyHz);
+    p = put32(p, stats->minPeriodInUs);
+    p = put32(p, stats->maxPeriodInUs);
+    p = put32(p, stats->avgPeriodInUs);
+    datagram->length = p - datagram->data;
+}
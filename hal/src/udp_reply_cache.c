@@ -0,0 +1,159 @@
+/* udp_reply_cache.c
+ *
+ * This file implements the reply cache. A table mutex guards which command
+ * line each entry belongs to; every entry also has a rwlock guarding its
+ * contents, so any number of workers can send the same cached reply at once
+ * while a rebuild waits for them to finish.
+ */
+
+#include "hal/udp_reply_cache.h"
+#include "hal/light_sensor.h"
+#include "hal/metrics.h"
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define MAX_KEY_LENGTH 128
+
+typedef struct {
+    // Guarded by tableMutex
+    char key[MAX_KEY_LENGTH];
+    unsigned long long lastUsed;
+
+    // Guarded by lock
+    pthread_rwlock_t lock;
+    bool valid;
+    char contentKey[MAX_KEY_LENGTH]; // Command line the reply was built for
+    UdpReplyCache_reply_t reply;
+} entry_t;
+
+static entry_t entries[UDP_REPLY_CACHE_ENTRIES];
+static unsigned long long useCounter = 0;
+static bool isInitialized = false;
+static pthread_mutex_t tableMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function Prototypes
+static void makeKey(const UdpCommands_context_t *ctx, char *key);
+static entry_t* findOrClaimEntry(const char *key);
+static bool isFresh(const entry_t *entry, const char *key);
+static void sendReply(UdpCommands_context_t *ctx, const UdpReplyCache_reply_t *reply);
+
+
+void UdpReplyCache_init(void) {
+    assert(!isInitialized);
+    for (int i = 0; i < UDP_REPLY_CACHE_ENTRIES; i++) {
+        entries[i].key[0] = '\0';
+        entries[i].lastUsed = 0;
+        entries[i].valid = false;
+        pthread_rwlock_init(&entries[i].lock, NULL);
+    }
+    useCounter = 0;
+    isInitialized = true;
+}
+
+void UdpReplyCache_cleanup(void) {
+    assert(isInitialized);
+    isInitialized = false;
+    for (int i = 0; i < UDP_REPLY_CACHE_ENTRIES; i++) {
+        pthread_rwlock_destroy(&entries[i].lock);
+    }
+}
+
+// Arguments joined by single spaces, so "history  " and "history" coalesce
+static void makeKey(const UdpCommands_context_t *ctx, char *key) {
+    size_t offset = 0;
+    key[0] = '\0';
+    for (int i = 0; i < ctx->argc; i++) {
+        size_t length = strlen(ctx->argv[i]);
+        if (offset + length + 2 > MAX_KEY_LENGTH) {
+            break;
+        }
+        if (i > 0) {
+            key[offset++] = ' ';
+        }
+        memcpy(key + offset, ctx->argv[i], length + 1);
+        offset += length;
+    }
+}
+
+static entry_t* findOrClaimEntry(const char *key) {
+    pthread_mutex_lock(&tableMutex);
+    entry_t *found = NULL;
+    entry_t *oldest = &entries[0];
+    for (int i = 0; i < UDP_REPLY_CACHE_ENTRIES && !found; i++) {
+        if (strcmp(entries[i].key, key) == 0) {
+            found = &entries[i];
+        } else if (entries[i].lastUsed < oldest->lastUsed) {
+            oldest = &entries[i];
+        }
+    }
+    if (!found) {
+        // Its old reply stays until a writer rebuilds it; isFresh() checks the key
+        found = oldest;
+        strcpy(found->key, key);
+    }
+    found->lastUsed = ++useCounter;
+    pthread_mutex_unlock(&tableMutex);
+    return found;
+}
+
+// Must be called with entry->lock held.
+static bool isFresh(const entry_t *entry, const char *key) {
+    return entry->valid
+        && entry->reply.epoch == Sampler_getHistoryEpoch()
+        && strcmp(entry->contentKey, key) == 0;
+}
+
+static void sendReply(UdpCommands_context_t *ctx, const UdpReplyCache_reply_t *reply) {
+    for (int i = 0; i < reply->numDatagrams; i++) {
+        UdpCommands_queue(ctx, reply->data + reply->offsets[i], reply->lengths[i]);
+    }
+    // The batch holds copies, so the entry may be rebuilt before they are sent
+}
+
+void UdpReplyCache_serve(UdpCommands_context_t *ctx, UdpReplyCache_builder_t builder) {
+    assert(isInitialized);
+    char key[MAX_KEY_LENGTH];
+    makeKey(ctx, key);
+    entry_t *entry = findOrClaimEntry(key);
+
+    pthread_rwlock_rdlock(&entry->lock);
+    if (isFresh(entry, key)) {
+        sendReply(ctx, &entry->reply);
+        pthread_rwlock_unlock(&entry->lock);
+        Metrics_add(METRICS_UDP_CACHE_HITS, 1);
+        return;
+    }
+    pthread_rwlock_unlock(&entry->lock);
+
+    // Stale: the first writer rebuilds, the others find it fresh
+    pthread_rwlock_wrlock(&entry->lock);
+    if (!isFresh(entry, key)) {
+        entry->reply.numDatagrams = 0;
+        entry->reply.used = 0;
+        builder(&entry->reply, ctx);
+        strcpy(entry->contentKey, key);
+        entry->valid = true;
+        Metrics_add(METRICS_UDP_CACHE_MISSES, 1);
+    } else {
+        Metrics_add(METRICS_UDP_CACHE_HITS, 1);
+    }
+    sendReply(ctx, &entry->reply);
+    pthread_rwlock_unlock(&entry->lock);
+}
+
+void UdpReplyCache_commit(UdpReplyCache_reply_t *reply, size_t length) {
+    assert(reply->numDatagrams < UDP_REPLY_CACHE_MAX_DATAGRAMS);
+    assert(reply->used + length <= UDP_REPLY_CACHE_DATA_SIZE);
+    reply->offsets[reply->numDatagrams] = reply->used;
+    reply->lengths[reply->numDatagrams] = length;
+    reply->numDatagrams++;
+    reply->used += length;
+}
+
+void UdpReplyCache_append(UdpReplyCache_reply_t *reply, const void *data, size_t length) {
+    assert(reply->used + length <= UDP_REPLY_CACHE_DATA_SIZE);
+    memcpy(reply->data + reply->used, data, length);
+    UdpReplyCache_commit(reply, length);
+}
@@ -0,0 +1,221 @@
+/* udp_sessions.c
+ *
+ * This file implements the UDP client session table and the rate limiter as
+ * two open addressing hash tables sharing one mutex. Sessions are keyed by IPv6
+ * address and port (IPv4 clients arrive as IPv4-mapped IPv6 addresses); rate
+ * limit buckets by host: the IPv4 address, or the /64 prefix of an IPv6 one.
+ * Entries are never deleted, only reused in place, so probe chains stay intact:
+ * a new client replaces the least recently seen session once the table is
+ * full, and a new host only takes the slot of a bucket that has refilled.
+ */
+
+#include "hal/udp_sessions.h"
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+typedef struct {
+    bool inUse;
+    struct sockaddr_in6 addr;
+    unsigned long long lastSeen; // Request counter value at the last request
+    char lastCommand[UDP_SESSIONS_MAX_COMMAND];
+} session_t;
+
+typedef struct {
+    bool inUse;
+    struct in6_addr host;        // See hostOf()
+    unsigned long long lastSeen;
+    long long tokensMilli;       // Token bucket, in thousandths of a request
+    long long lastRefillMs;
+} bucket_t;
+
+static session_t sessions[UDP_SESSIONS_MAX_CLIENTS];
+static bucket_t buckets[UDP_SESSIONS_MAX_HOSTS];
+static bucket_t overflowBucket;  // Shared by new hosts while no bucket can be reused
+static int sessionCount = 0;
+static unsigned long long requestCounter = 0;
+static bool isInitialized = false;
+static pthread_mutex_t sessionMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function Prototypes
+static uint32_t hashBytes(uint32_t hash, const void *data, size_t size);
+static unsigned int hashAddress(const struct sockaddr_in6 *addr);
+static bool sameAddress(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b);
+static session_t* findOrCreateSession(const struct sockaddr_in6 *addr);
+static void resetSession(session_t *session, const struct sockaddr_in6 *addr);
+static struct in6_addr hostOf(const struct sockaddr_in6 *addr);
+static long long refilledTokens(const bucket_t *bucket, long long now);
+static bucket_t* findOrCreateBucket(const struct sockaddr_in6 *addr, long long now);
+static void resetBucket(bucket_t *bucket, const struct in6_addr *host, long long now);
+static long long nowInMs(void);
+
+
+void UdpSessions_init(void) {
+    assert(!isInitialized);
+    memset(sessions, 0, sizeof(sessions));
+    memset(buckets, 0, sizeof(buckets));
+    resetBucket(&overflowBucket, &in6addr_any, nowInMs());
+    sessionCount = 0;
+    requestCounter = 0;
+    isInitialized = true;
+}
+
+void UdpSessions_cleanup(void) {
+    assert(isInitialized);
+    isInitialized = false;
+}
+
+// FNV-1a; start with 2166136261u
+static uint32_t hashBytes(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int hashAddress(const struct sockaddr_in6 *addr) {
+    uint32_t hash = hashBytes(2166136261u, &addr->sin6_addr, sizeof(addr->sin6_addr));
+    hash = hashBytes(hash, &addr->sin6_port, sizeof(addr->sin6_port));
+    return hash % UDP_SESSIONS_MAX_CLIENTS;
+}
+
+// One host per IPv4 address or IPv6 /64, so changing the source port (or the
+// interface ID) does not give a client a fresh bucket
+static struct in6_addr hostOf(const struct sockaddr_in6 *addr) {
+    struct in6_addr host = addr->sin6_addr;
+    if (!IN6_IS_ADDR_V4MAPPED(&host)) {
+        memset(&host.s6_addr[8], 0, 8);
+    }
+    return host;
+}
+
+static long long nowInMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static bool sameAddress(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b) {
+    return a->sin6_port == b->sin6_port && IN6_ARE_ADDR_EQUAL(&a->sin6_addr, &b->sin6_addr);
+}
+
+// Must be called with sessionMutex held.
+static session_t* findOrCreateSession(const struct sockaddr_in6 *addr) {
+    unsigned int start = hashAddress(addr);
+    session_t *oldest = NULL;
+
+    for (int probe = 0; probe < UDP_SESSIONS_MAX_CLIENTS; probe++) {
+        session_t *session = &sessions[(start + probe) % UDP_SESSIONS_MAX_CLIENTS];
+        if (!session->inUse) {
+            session->inUse = true;
+            resetSession(session, addr);
+            sessionCount++;
+            return session;
+        }
+        if (sameAddress(&session->addr, addr)) {
+            return session;
+        }
+        if (!oldest || session->lastSeen < oldest->lastSeen) {
+            oldest = session;
+        }
+    }
+
+    // Table full: forget the least recently seen client
+    resetSession(oldest, addr);
+    return oldest;
+}
+
+static void resetSession(session_t *session, const struct sockaddr_in6 *addr) {
+    session->addr = *addr;
+    session->lastCommand[0] = '\0';
+}
+
+// UDP_SESSIONS_RATE_PER_S tokens per 1000 ms, capped at the burst
+static long long refilledTokens(const bucket_t *bucket, long long now) {
+    long long tokensMilli = bucket->tokensMilli + (now - bucket->lastRefillMs) * UDP_SESSIONS_RATE_PER_S;
+    return (tokensMilli > UDP_SESSIONS_BURST * 1000LL) ? UDP_SESSIONS_BURST * 1000LL : tokensMilli;
+}
+
+static void resetBucket(bucket_t *bucket, const struct in6_addr *host, long long now) {
+    bucket->host = *host;
+    bucket->tokensMilli = UDP_SESSIONS_BURST * 1000LL;
+    bucket->lastRefillMs = now;
+}
+
+// Only a full bucket is reused: forgetting it loses nothing, while reusing a
+// drained one would hand its host a fresh burst. Must be called with
+// sessionMutex held.
+static bucket_t* findOrCreateBucket(const struct sockaddr_in6 *addr, long long now) {
+    struct in6_addr host = hostOf(addr);
+    unsigned int start = hashBytes(2166136261u, &host, sizeof(host)) % UDP_SESSIONS_MAX_HOSTS;
+    bucket_t *reusable = NULL;
+
+    for (int probe = 0; probe < UDP_SESSIONS_MAX_HOSTS; probe++) {
+        bucket_t *bucket = &buckets[(start + probe) % UDP_SESSIONS_MAX_HOSTS];
+        if (!bucket->inUse) {
+            bucket->inUse = true;
+            resetBucket(bucket, &host, now);
+            return bucket;
+        }
+        if (IN6_ARE_ADDR_EQUAL(&bucket->host, &host)) {
+            return bucket;
+        }
+        bool isFull = refilledTokens(bucket, now) >= UDP_SESSIONS_BURST * 1000LL;
+        if (isFull && (!reusable || bucket->lastSeen < reusable->lastSeen)) {
+            reusable = bucket;
+        }
+    }
+
+    if (!reusable) {
+        return &overflowBucket; // Every known host is still being limited
+    }
+    resetBucket(reusable, &host, now);
+    return reusable;
+}
+
+bool UdpSessions_resolveCommand(const struct sockaddr_in6 *addr, char *command, size_t size) {
+    assert(isInitialized);
+    bool resolved = true;
+
+    pthread_mutex_lock(&sessionMutex);
+    session_t *session = findOrCreateSession(addr);
+    session->lastSeen = ++requestCounter;
+
+    if (command[0] == '\0') {
+        if (session->lastCommand[0] == '\0') {
+            resolved = false;
+        } else {
+            strncpy(command, session->lastCommand, size - 1);
+            command[size - 1] = '\0';
+        }
+    } else {
+        strncpy(session->lastCommand, command, sizeof(session->lastCommand) - 1);
+        session->lastCommand[sizeof(session->lastCommand) - 1] = '\0';
+    }
+    pthread_mutex_unlock(&sessionMutex);
+
+    return resolved;
+}
+
+bool UdpSessions_admitRequest(const struct sockaddr_in6 *addr) {
+    assert(isInitialized);
+    long long now = nowInMs();
+    bool admitted = false;
+
+    pthread_mutex_lock(&sessionMutex);
+    bucket_t *bucket = findOrCreateBucket(addr, now);
+    bucket->lastSeen = ++requestCounter;
+    bucket->tokensMilli = refilledTokens(bucket, now);
+    bucket->lastRefillMs = now;
+
+    if (bucket->tokensMilli >= 1000) {
+        bucket->tokensMilli -= 1000;
+        admitted = true;
+    }
+    pthread_mutex_unlock(&sessionMutex);
+
+    return admitted;
+}
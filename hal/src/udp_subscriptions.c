@@ -0,0 +1,315 @@
+/* udp_subscriptions.c
+ *
+ * This file implements push subscriptions for the UDP listener. The Sampler
+ * thread copies each completed second into a small queue of frames and signals
+ * an eventfd; the listener's event loop then encodes every frame once and sends
+ * it to all subscribers whose lease has not expired, plus the multicast group
+ * if one is set.
+ */
+
+#include "hal/udp_subscriptions.h"
+#include "hal/udp_protocol.h"
+#include "hal/udp_batch.h"
+#include "hal/udp_commands.h"
+#include "hal/udp_history_archive.h"
+#include "hal/light_sensor.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#define QUEUE_DEPTH 4 // Seconds of data buffered while the publisher catches up
+
+typedef struct {
+    bool inUse;
+    struct sockaddr_in6 addr;
+    time_t leaseExpiry;
+} subscriber_t;
+
+typedef struct {
+    uint32_t epoch;
+    int sampleCount;
+    uint16_t samples[MAX_HISTORY_SIZE];
+    UdpProtocol_stats_t stats;
+} frame_t;
+
+static subscriber_t subscribers[UDP_SUBSCRIPTIONS_MAX_SUBSCRIBERS];
+static frame_t queue[QUEUE_DEPTH];
+static int queueHead = 0;  // Next frame to publish
+static int queueCount = 0;
+
+static bool multicastEnabled = false;
+static struct sockaddr_in6 multicastAddr;
+
+static int sendSocket = -1;
+static struct UdpBatch *batch = NULL;
+static int frameEventFd = -1;
+static bool isInitialized = false;
+static pthread_mutex_t subscriptionMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function Prototypes
+static void publishFrame(const frame_t *frame);
+static time_t nowInSeconds(void);
+static bool sameAddress(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b);
+static void onSubscribe(UdpCommands_context_t *ctx);
+static void onUnsubscribe(UdpCommands_context_t *ctx);
+static void onMulticast(UdpCommands_context_t *ctx);
+static bool parseMulticastGroup(const char *group, struct sockaddr_in6 *addr);
+
+static const UdpCommands_command_t subscriptionCommands[] = {
+    { "subscribe", "[seconds:int]", "push bstats and bhistory delta every second (renew before the lease ends).", onSubscribe },
+    { "unsubscribe", "", "stop the pushes.", onUnsubscribe },
+    { "multicast", "<on|off> [group:word]", "also push every second to a multicast group (default "
+        UDP_SUBSCRIPTIONS_MULTICAST_GROUP ").", onMulticast },
+};
+
+
+static time_t nowInSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static bool sameAddress(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b) {
+    return a->sin6_port == b->sin6_port && IN6_ARE_ADDR_EQUAL(&a->sin6_addr, &b->sin6_addr);
+}
+
+void UdpSubscriptions_init(int sockfd) {
+    assert(!isInitialized);
+    sendSocket = sockfd;
+    memset(subscribers, 0, sizeof(subscribers));
+    multicastEnabled = false;
+    queueHead = 0;
+    queueCount = 0;
+    batch = UdpBatch_create();
+    frameEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (frameEventFd < 0) {
+        perror("Unable to create subscription eventfd");
+        exit(EXIT_FAILURE);
+    }
+    isInitialized = true;
+    UdpCommands_registerAll(subscriptionCommands, sizeof(subscriptionCommands) / sizeof(subscriptionCommands[0]));
+}
+
+void UdpSubscriptions_cleanup(void) {
+    assert(isInitialized);
+    pthread_mutex_lock(&subscriptionMutex);
+    isInitialized = false;
+    pthread_mutex_unlock(&subscriptionMutex);
+    close(frameEventFd);
+    UdpBatch_destroy(batch);
+}
+
+bool UdpSubscriptions_subscribe(const struct sockaddr_in6 *addr, int leaseSeconds) {
+    assert(isInitialized);
+    if (leaseSeconds <= 0) leaseSeconds = UDP_SUBSCRIPTIONS_DEFAULT_LEASE_S;
+    if (leaseSeconds > UDP_SUBSCRIPTIONS_MAX_LEASE_S) leaseSeconds = UDP_SUBSCRIPTIONS_MAX_LEASE_S;
+
+    time_t now = nowInSeconds();
+    subscriber_t *freeSlot = NULL;
+    bool subscribed = false;
+
+    pthread_mutex_lock(&subscriptionMutex);
+    for (int i = 0; i < UDP_SUBSCRIPTIONS_MAX_SUBSCRIBERS; i++) {
+        subscriber_t *sub = &subscribers[i];
+        if (sub->inUse && sub->leaseExpiry <= now) {
+            sub->inUse = false; // Reclaim expired leases
+        }
+        if (sub->inUse && sameAddress(&sub->addr, addr)) {
+            sub->leaseExpiry = now + leaseSeconds; // Renew
+            subscribed = true;
+            break;
+        }
+        if (!sub->inUse && !freeSlot) {
+            freeSlot = sub;
+        }
+    }
+    if (!subscribed && freeSlot) {
+        freeSlot->inUse = true;
+        freeSlot->addr = *addr;
+        freeSlot->leaseExpiry = now + leaseSeconds;
+        subscribed = true;
+    }
+    pthread_mutex_unlock(&subscriptionMutex);
+
+    return subscribed;
+}
+
+bool UdpSubscriptions_unsubscribe(const struct sockaddr_in6 *addr) {
+    assert(isInitialized);
+    bool found = false;
+
+    pthread_mutex_lock(&subscriptionMutex);
+    for (int i = 0; i < UDP_SUBSCRIPTIONS_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].inUse && sameAddress(&subscribers[i].addr, addr)) {
+            subscribers[i].inUse = false;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&subscriptionMutex);
+
+    return found;
+}
+
+static void onSubscribe(UdpCommands_context_t *ctx) {
+    int lease = (ctx->argc > 1) ? atoi(ctx->argv[1]) : UDP_SUBSCRIPTIONS_DEFAULT_LEASE_S;
+    if (UdpSubscriptions_subscribe(ctx->addr, lease)) {
+        UdpCommands_reply(ctx, "Subscribed.\n");
+    } else {
+        UdpCommands_reply(ctx, "Too many subscribers.\n");
+    }
+}
+
+static void onUnsubscribe(UdpCommands_context_t *ctx) {
+    UdpCommands_reply(ctx, UdpSubscriptions_unsubscribe(ctx->addr) ? "Unsubscribed.\n" : "Not subscribed.\n");
+}
+
+// Accept IPv6 groups as they are and IPv4 groups as IPv4-mapped addresses,
+// which the dual stack socket sends as plain IPv4
+static bool parseMulticastGroup(const char *group, struct sockaddr_in6 *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin6_family = AF_INET6;
+    addr->sin6_port = htons(UDP_SUBSCRIPTIONS_MULTICAST_PORT);
+
+    if (inet_pton(AF_INET6, group, &addr->sin6_addr) == 1) {
+        return IN6_IS_ADDR_MULTICAST(&addr->sin6_addr);
+    }
+    struct in_addr ipv4;
+    if (inet_pton(AF_INET, group, &ipv4) == 1 && IN_MULTICAST(ntohl(ipv4.s_addr))) {
+        addr->sin6_addr.s6_addr[10] = 0xFF;
+        addr->sin6_addr.s6_addr[11] = 0xFF;
+        memcpy(&addr->sin6_addr.s6_addr[12], &ipv4, sizeof(ipv4));
+        return true;
+    }
+    return false;
+}
+
+bool UdpSubscriptions_setMulticast(const char *group) {
+    assert(isInitialized);
+    struct sockaddr_in6 addr;
+    if (group && !parseMulticastGroup(group, &addr)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&subscriptionMutex);
+    multicastEnabled = (group != NULL);
+    if (group) {
+        multicastAddr = addr;
+    }
+    pthread_mutex_unlock(&subscriptionMutex);
+    return true;
+}
+
+static void onMulticast(UdpCommands_context_t *ctx) {
+    if (strcmp(ctx->argv[1], "off") == 0) {
+        UdpSubscriptions_setMulticast(NULL);
+        UdpCommands_reply(ctx, "Multicast off.\n");
+        return;
+    }
+    const char *group = (ctx->argc > 2) ? ctx->argv[2] : UDP_SUBSCRIPTIONS_MULTICAST_GROUP;
+    if (UdpSubscriptions_setMulticast(group)) {
+        UdpCommands_replyf(ctx, "Multicast on: %s port %d.\n", group, UDP_SUBSCRIPTIONS_MULTICAST_PORT);
+    } else {
+        UdpCommands_reply(ctx, "Not a multicast group address.\n");
+    }
+}
+
+void UdpSubscriptions_notifyNewHistory(void) {
+    // Collect outside the lock; the Sampler has its own locking
+    static frame_t incoming;
+    incoming.sampleCount = Sampler_getHistoryRaw(incoming.samples, MAX_HISTORY_SIZE, &incoming.epoch);
+    UdpProtocol_collectStats(&incoming.stats);
+
+    pthread_mutex_lock(&subscriptionMutex);
+    if (isInitialized) {
+        if (queueCount == QUEUE_DEPTH) {
+            // Publisher fell behind: drop the oldest, clients see the epoch gap
+            queueHead = (queueHead + 1) % QUEUE_DEPTH;
+            queueCount--;
+        }
+        queue[(queueHead + queueCount) % QUEUE_DEPTH] = incoming;
+        queueCount++;
+        uint64_t one = 1;
+        if (write(frameEventFd, &one, sizeof(one)) != sizeof(one)) {
+            perror("Unable to signal subscription eventfd");
+        }
+    }
+    pthread_mutex_unlock(&subscriptionMutex);
+}
+
+int UdpSubscriptions_getEventFd(void) {
+    assert(isInitialized);
+    return frameEventFd;
+}
+
+void UdpSubscriptions_publishPending(void) {
+    assert(isInitialized);
+    static frame_t frame;
+
+    // Clear the eventfd; EAGAIN only means nothing new was signalled
+    uint64_t pending;
+    ssize_t ignored = read(frameEventFd, &pending, sizeof(pending));
+    (void)ignored;
+
+    pthread_mutex_lock(&subscriptionMutex);
+    while (queueCount > 0) {
+        frame = queue[queueHead];
+        queueHead = (queueHead + 1) % QUEUE_DEPTH;
+        queueCount--;
+
+        pthread_mutex_unlock(&subscriptionMutex);
+        publishFrame(&frame);
+        pthread_mutex_lock(&subscriptionMutex);
+    }
+    pthread_mutex_unlock(&subscriptionMutex);
+}
+
+static void publishFrame(const frame_t *frame) {
+    static UdpProtocol_datagram_t datagrams[UDP_PROTOCOL_MAX_HISTORY_DATAGRAMS + 1];
+    struct sockaddr_in6 targets[UDP_SUBSCRIPTIONS_MAX_SUBSCRIBERS + 1]; // Plus the multicast group
+    int numTargets = 0;
+
+    // Snapshot live subscribers so sends happen without holding the lock
+    time_t now = nowInSeconds();
+    pthread_mutex_lock(&subscriptionMutex);
+    for (int i = 0; i < UDP_SUBSCRIPTIONS_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].inUse && subscribers[i].leaseExpiry <= now) {
+            subscribers[i].inUse = false;
+        }
+        if (subscribers[i].inUse) {
+            targets[numTargets++] = subscribers[i].addr;
+        }
+    }
+    if (multicastEnabled) {
+        targets[numTargets++] = multicastAddr; // One send for every observer in the group
+    }
+    pthread_mutex_unlock(&subscriptionMutex);
+
+    if (numTargets == 0) {
+        return;
+    }
+
+    UdpProtocol_encodeStats(&frame->stats, frame->epoch, &datagrams[0]);
+    int numDatagrams = 1 + UdpProtocol_encodeHistory(frame->samples, frame->sampleCount,
+        frame->epoch, true, &datagrams[1], UDP_PROTOCOL_MAX_HISTORY_DATAGRAMS);
+    UdpHistoryArchive_store(frame->epoch, true, &datagrams[1], numDatagrams - 1);
+
+    // One batched send for every datagram to every subscriber
+    for (int t = 0; t < numTargets; t++) {
+        for (int i = 0; i < numDatagrams; i++) {
+            if (!UdpBatch_add(batch, datagrams[i].data, datagrams[i].length,
+                    (const struct sockaddr*)&targets[t], sizeof(targets[t]))) {
+                UdpBatch_send(batch, sendSocket);
+                UdpBatch_add(batch, datagrams[i].data, datagrams[i].length,
+                    (const struct sockaddr*)&targets[t], sizeof(targets[t]));
+            }
+        }
+    }
+    UdpBatch_send(batch, sendSocket);
+}